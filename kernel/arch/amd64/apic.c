@@ -1,14 +1,30 @@
 #include <arch/amd64/apic.h>
 #include <arch/amd64/msr.h>
+#include <atomic.h>
 #include <mmu.h>
 #include <stddef.h>
 
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_BSP 0x100 // Processor is a BSP
 #define IA32_APIC_BASE_MSR_ENABLE 0x800
+#define IA32_APIC_BASE_MSR_X2APIC 0x400
+
+// In x2APIC mode the registers are MSRs starting here, one per 16 bytes
+// of the memory mapped layout.
+#define X2APIC_MSR_BASE 0x800
+
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_ICR_PENDING (1 << 12)
+#define APIC_EOI 0xB0
+#define APIC_SPURIOUS 0xF0
+#define APIC_SOFTWARE_ENABLE 0x100
 
 void *apic_physical_base;
 void *apic_virtual_base;
+// Set once the local APIC of the BSP is in x2APIC mode, which is needed
+// to send IPIs to APIC IDs above 0xFF.
+bool apic_x2apic = false;
 
 bool apic_check(void) {
   struct cpuid_values values;
@@ -42,11 +58,18 @@ void apic_set_base(void *apic) {
 }
 
 void apic_write_register(u16 reg, u32 value) {
+  if (apic_x2apic) {
+    msr_set(X2APIC_MSR_BASE + (reg >> 4), value);
+    return;
+  }
   u32 *ptr = (u32 *)((u8 *)apic_virtual_base + reg);
   *ptr = value;
 }
 
 u32 apic_read_register(u16 reg) {
+  if (apic_x2apic) {
+    return msr_get(X2APIC_MSR_BASE + (reg >> 4));
+  }
   u32 *ptr = (u32 *)((u8 *)apic_virtual_base + reg);
   return *ptr;
 }
@@ -65,6 +88,56 @@ bool apic_enable(void) {
 
   apic_map_base();
 
-  apic_write_register(0xF0, apic_read_register(0xF0) | 0x100);
+  // Has to go through xAPIC mode, which apic_set_base() enabled.
+  struct cpuid_values values;
+  cpuid(1, &values);
+  if (values.ecx & CPUID_FEAT_ECX_X2APIC) {
+    msr_set(IA32_APIC_BASE_MSR,
+            msr_get(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_MSR_X2APIC);
+    apic_x2apic = true;
+  }
+
+  apic_write_register(APIC_SPURIOUS,
+                      apic_read_register(APIC_SPURIOUS) | APIC_SOFTWARE_ENABLE);
   return true;
 }
+
+// For the other cores, once apic_enable() has run on the BSP. Their
+// APIC is enabled in xAPIC mode after INIT and the registers are already
+// mapped.
+bool apic_enable_core(void) {
+  if (apic_x2apic) {
+    msr_set(IA32_APIC_BASE_MSR,
+            msr_get(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_MSR_X2APIC);
+  }
+  apic_write_register(APIC_SPURIOUS,
+                      apic_read_register(APIC_SPURIOUS) | APIC_SOFTWARE_ENABLE);
+  return true;
+}
+
+// Returns false if the APIC ID can not be addressed in xAPIC mode.
+bool apic_send_ipi(u32 apic_id, u32 command) {
+  if (apic_x2apic) {
+    // x2APIC does not support the INIT level de-assert.
+    if (APIC_IPI_INIT_DEASSERT == command) {
+      return true;
+    }
+    msr_set(X2APIC_MSR_BASE + (APIC_ICR_LOW >> 4),
+            ((u64)apic_id << 32) | command);
+    return true;
+  }
+  if (apic_id > 0xFF) {
+    return false;
+  }
+  apic_write_register(APIC_ICR_HIGH, apic_id << 24);
+  apic_write_register(APIC_ICR_LOW, command);
+  for (; apic_read_register(APIC_ICR_LOW) & APIC_ICR_PENDING;) {
+    cpu_relax();
+  }
+  return true;
+}
+
+// Ends the handling of an interrupt sent by an APIC, such as an IPI.
+void apic_eoi(void) {
+  apic_write_register(APIC_EOI, 0);
+}
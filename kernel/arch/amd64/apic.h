@@ -1,7 +1,21 @@
 #include <stdbool.h>
 #include <typedefs.h>
 
+#define APIC_ERROR_STATUS 0x280
+
+#define APIC_IPI_INIT 0x00C500
+#define APIC_IPI_INIT_DEASSERT 0x008500
+// Starts the core at 0x8000.
+#define APIC_IPI_STARTUP 0x000608
+// Delivers the interrupt vector in the low byte.
+#define APIC_IPI_FIXED 0x004000
+
 bool apic_enable(void);
+bool apic_enable_core(void);
 bool apic_check(void);
 void* apic_get_base(void);
 void apic_set_base(void* apic);
+void apic_write_register(u16 reg, u32 value);
+u32 apic_read_register(u16 reg);
+bool apic_send_ipi(u32 apic_id, u32 command);
+void apic_eoi(void);
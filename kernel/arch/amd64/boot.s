@@ -128,9 +128,10 @@ _start:
     wrmsr
 	mov edx, edi
 
-    ; Enable paging
+    ; Enable paging and make ring 0 respect read only pages(needed
+    ; for copy-on-write)
     mov eax, cr0
-    or eax, 1 << 31
+    or eax, 1 << 31 | 1 << 16
     mov cr0, eax
 
     lgdt [GDT.Pointer]
@@ -1,6 +1,10 @@
 #include <arch/amd64/idt.h>
+#include <arch/amd64/preempt.h>
+#include <arch/amd64/regs.h>
 #include <io.h>
 #include <kprintf.h>
+#include <mm/guard.h>
+#include <mmu.h>
 #include <stddef.h>
 #include <string.h>
 #include <typedefs.h>
@@ -183,18 +187,26 @@ void interrupt_dispatch(struct cpu_status *r) {
     return;
   }
 
+  irq_enter();
   handler(r);
+  irq_exit();
 }
 
 void page_fault(struct cpu_status *r) {
-  (void)r;
-  kprintf("Page fault\n");
+  void *address = (void *)get_cr2();
+  if (mmu_handle_page_fault(address, r->error_code)) {
+    return;
+  }
+  guard_report_fault(address);
+  kprintf("Page fault at: %x\n", address);
+  kprintf("Error code: %x\n", r->error_code);
   for (;;)
     ;
 }
 
+// Vectors 0x20 to 0x2F are the PIC lines, which get unmasked.
 void handler_install(uint8_t num, interrupt_handler handler) {
-  if (num >= 0x20) {
+  if (num >= 0x20 && num < 0x30) {
     irq_clear_mask(num - 0x20);
   }
   set_idt_entry(num, (void *)isr_list[num], 0);
@@ -209,8 +221,14 @@ void idt_init(void) {
     irq_set_mask(i);
   }
 
-  //  handler_install(0x0E, page_fault);
+  handler_install(0x0E, page_fault);
+
+  load_idt(idt);
+  interrupts_enable();
+}
 
+// The other cores share the table set up by idt_init().
+void idt_init_core(void) {
   load_idt(idt);
   interrupts_enable();
 }
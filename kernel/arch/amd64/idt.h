@@ -33,8 +33,13 @@ struct cpu_status {
 typedef void(*interrupt_handler)(struct cpu_status *);
 
 void idt_init(void);
+void idt_init_core(void);
 void interrupts_enable(void);
 void interrupts_disable(void);
+// Interrupt flag in the value returned by interrupts_save_disable().
+#define RFLAGS_IF (1 << 9)
+u64 interrupts_save_disable(void);
+void interrupts_restore(u64 flags);
 void handler_install(uint8_t num, interrupt_handler handler);
 void eoi(u8 irq);
 
@@ -1,6 +1,8 @@
 global asm_load_idt
 global interrupts_enable
 global interrupts_disable
+global interrupts_save_disable
+global interrupts_restore
 global load_gdt
 
 global get_current_sp
@@ -60,6 +62,21 @@ interrupts_disable:
 	cli
 	ret
 
+; Returns RFLAGS from before interrupts got disabled, so that
+; interrupts_restore() only enables them if they were enabled before.
+interrupts_save_disable:
+	pushfq
+	pop rax
+	cli
+	ret
+
+interrupts_restore:
+	test rdi, 1 << 9
+	jz .done
+	sti
+.done:
+	ret
+
 %macro ISR_NOERRCODE 1
     global isr%1
 isr%1:
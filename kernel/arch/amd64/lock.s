@@ -1,18 +1,54 @@
 section .text
 
+extern preempt_disable
+extern preempt_enable
+
 global lock_acquire
 global lock_release
-lock_acquire:
-    lock bts dword [rdi],0        ;Attempt to acquire the lock (in case lock is uncontended)
-    jc .spin_with_pause
-    ret
 
+; lock_t is a ticket lock. The low word is the ticket being served and
+; the high word the next ticket to hand out. Waiters are served in the
+; order they arrived. The holder can not be switched away from, its
+; core's preempt count is raised until the release.
+lock_acquire:
+    push rdi
+    call preempt_disable
+    pop rdi
+    mov eax, 0x10000
+    lock xadd dword [rdi], eax    ;Take a ticket, eax holds the old value
+    mov edx, eax
+    shr edx, 16                   ;Our ticket
 .spin_with_pause:
-    pause ; Tell CPU we're spinning
-    test dword [rdi],1 ; Is the lock free?
-    jnz .spin_with_pause ; no, wait
-    jmp lock_acquire ; retry
+    cmp ax, dx                    ;Is it our turn?
+    je .done
+    pause                         ;Tell CPU we're spinning
+    mov ax, word [rdi]
+    jmp .spin_with_pause
+.done:
+    ret
 
 lock_release:
-    mov dword [rdi],0
+    lock add word [rdi], 1        ;Serve the next ticket
+    jmp preempt_enable
+
+global lock_acquire_irqsave
+global lock_release_irqrestore
+
+; Returns RFLAGS from before interrupts were disabled.
+lock_acquire_irqsave:
+    pushfq
+    cli
+    call lock_acquire
+    pop rax
+    ret
+
+lock_release_irqrestore:
+    lock add word [rdi], 1
+    push rsi
+    call preempt_enable
+    pop rsi
+    test rsi, 1 << 9              ;Were interrupts enabled before?
+    jz .done
+    sti
+.done:
     ret
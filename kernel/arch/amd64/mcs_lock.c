@@ -0,0 +1,93 @@
+// Defines the functions that LOCKSTAT would wrap.
+#define LOCK_IMPLEMENTATION
+#include <arch/amd64/idt.h>
+#include <arch/amd64/preempt.h>
+#include <atomic.h>
+#include <lock.h>
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef KERNEL_TEST
+#include <arch/amd64/msr.h>
+#include <arch/amd64/smp.h>
+#include <kprintf.h>
+#endif // KERNEL_TEST
+
+// The lock points at the last waiter. A new waiter swaps itself in as
+// the tail and links itself behind the previous one, which clears its
+// `waiting` flag on release. So every waiter only spins on the cache
+// line of its own node.
+
+void mcs_lock_acquire(struct mcs_lock *lock, struct mcs_node *node) {
+  preempt_disable();
+  node->next = NULL;
+  node->waiting = 1;
+  struct mcs_node *prev = atomic_xchg_acq_rel(&lock->tail, node);
+  if (!prev) {
+    return;
+  }
+  atomic_store_release(&prev->next, node);
+  for (; atomic_load_acquire(&node->waiting);) {
+    cpu_relax();
+  }
+}
+
+void mcs_lock_release(struct mcs_lock *lock, struct mcs_node *node) {
+  struct mcs_node *next = atomic_load_acquire(&node->next);
+  if (!next) {
+    struct mcs_node *expected = node;
+    if (atomic_cmpxchg_release(&lock->tail, &expected, NULL)) {
+      preempt_enable();
+      return;
+    }
+    // A waiter has swapped itself in but not linked itself yet.
+    for (; !(next = atomic_load_acquire(&node->next));) {
+      cpu_relax();
+    }
+  }
+  atomic_store_release(&next->waiting, 0);
+  preempt_enable();
+}
+
+u64 mcs_lock_acquire_irqsave(struct mcs_lock *lock, struct mcs_node *node) {
+  u64 flags = interrupts_save_disable();
+  mcs_lock_acquire(lock, node);
+  return flags;
+}
+
+void mcs_lock_release_irqrestore(struct mcs_lock *lock, struct mcs_node *node,
+                                 u64 flags) {
+  mcs_lock_release(lock, node);
+  interrupts_restore(flags);
+}
+
+#ifdef KERNEL_TEST
+lock_t lock_benchmark_ticket;
+struct mcs_lock lock_benchmark_mcs;
+u64 lock_benchmark_counter;
+
+// Meant to be run on every core at the same time. The handover cost of
+// the MCS lock should stay flat as cores are added since no two waiters
+// spin on the same line, the ticket lock is there to compare against.
+u64 lock_benchmark(u32 rounds) {
+  u64 start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    lock_acquire(&lock_benchmark_ticket);
+    lock_benchmark_counter++;
+    lock_release(&lock_benchmark_ticket);
+  }
+  u64 ticket_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    struct mcs_node node;
+    mcs_lock_acquire(&lock_benchmark_mcs, &node);
+    lock_benchmark_counter++;
+    mcs_lock_release(&lock_benchmark_mcs, &node);
+  }
+  u64 mcs_cycles = rdtsc() - start;
+
+  kprintf("lock: core %d: ticket: %ld mcs: %ld cycles per acquire\n",
+          core_id_get(), ticket_cycles / rounds, mcs_cycles / rounds);
+  return mcs_cycles;
+}
+#endif // KERNEL_TEST
@@ -1,9 +1,12 @@
 #include <arch/amd64/smp.h>
+#include <arch/amd64/tlb.h>
 #include <assert.h>
+#include <atomic.h>
 #include <kprintf.h>
+#include <lock.h>
+#include <mm/reclaim.h>
 #include <mmu.h>
 #include <multiboot2.h>
-#include <prng.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -11,20 +14,11 @@
 
 bool active_bootstrap = true;
 
-struct kernel_thread {
-  struct mmu_directory *active_directory;
-};
-
-#define MAX_CORES 64
-// FIXME: Limited to 64 cores
-struct kernel_thread kernel_threads[MAX_CORES];
+// The directory the BSP started with, new cores start from a copy.
+struct mmu_directory *kernel_directory = NULL;
 
 void flush_tlb(void);
 
-#define PAGE_SIZE 0x1000
-
-#define PAGE_FLAG_PRESENT (1 << 0)
-
 struct PT {
   uintptr_t page[512];
 };
@@ -76,6 +70,16 @@ struct mmu_directory orig_active_directory;
 uint64_t frames[NUM_OF_FRAMES];
 size_t num_pages = 0;
 
+// Number of additional mappings a frame has on top of the one that
+// allocated it. Frames are only given back once this reaches zero.
+u16 frame_references[NUM_OF_FRAMES * 64];
+
+// Covers `frames` and `frame_references`. Frames are given back from
+// interrupt handlers as well, so it is only taken with interrupts
+// disabled.
+lock_t frame_lock;
+
+// Called with frame_lock held, or at boot before other cores run.
 static inline bool set_frame(void *address, bool state) {
   uintptr_t a = (uintptr_t)address;
   a /= 0x1000;
@@ -85,15 +89,46 @@ static inline bool set_frame(void *address, bool state) {
   }
   size_t offset = a % 64;
   if (state) {
-    frames[index] |= (1 << offset);
+    frames[index] |= ((uint64_t)1 << offset);
   } else {
-    frames[index] &= ~(1 << offset);
+    frames[index] &= ~((uint64_t)1 << offset);
   }
   return true;
 }
 
-void *get_frame(bool allocate, u64 count) {
-  assert(0 != count);
+void mmu_frame_share(void *physical) {
+  uintptr_t a = (uintptr_t)physical / PAGE_SIZE;
+  assert(a < NUM_OF_FRAMES * 64);
+  u64 flags = lock_acquire_irqsave(&frame_lock);
+  assert(frame_references[a] < U16_MAX);
+  frame_references[a]++;
+  lock_release_irqrestore(&frame_lock, flags);
+}
+
+void mmu_frame_release(void *physical) {
+  uintptr_t a = (uintptr_t)physical / PAGE_SIZE;
+  if (a >= NUM_OF_FRAMES * 64) {
+    return;
+  }
+  u64 flags = lock_acquire_irqsave(&frame_lock);
+  if (frame_references[a] > 0) {
+    frame_references[a]--;
+  } else {
+    set_frame(physical, false);
+  }
+  lock_release_irqrestore(&frame_lock, flags);
+}
+
+u16 mmu_frame_references(void *physical) {
+  uintptr_t a = (uintptr_t)physical / PAGE_SIZE;
+  if (a >= NUM_OF_FRAMES * 64) {
+    return 0;
+  }
+  return frame_references[a];
+}
+
+// Called with frame_lock held.
+static void *find_free_frames_locked(bool allocate, u64 count) {
   u64 left = count;
   void *rc = NULL;
   for (size_t i = 0; i < NUM_OF_FRAMES; i++) {
@@ -103,7 +138,7 @@ void *get_frame(bool allocate, u64 count) {
     }
 
     for (size_t j = 0; j < 64; j++) {
-      if (frames[i] & (1 << j)) {
+      if (frames[i] & ((uint64_t)1 << j)) {
         left = count;
         continue;
       }
@@ -124,10 +159,40 @@ void *get_frame(bool allocate, u64 count) {
       }
     }
   }
+  return NULL;
+}
+
+static void *find_free_frames(bool allocate, u64 count) {
+  u64 flags = lock_acquire_irqsave(&frame_lock);
+  void *rc = find_free_frames_locked(allocate, count);
+  lock_release_irqrestore(&frame_lock, flags);
+  return rc;
+}
+
+void *get_frame(bool allocate, u64 count) {
+  assert(0 != count);
+  for (;;) {
+    void *rc = find_free_frames(allocate, count);
+    if (rc) {
+      return rc;
+    }
+    // Out of frames, try moving cold pages out of memory. If another
+    // task is already doing so this waits for it, either way the frames
+    // may be taken by someone else before the retry.
+    if (0 == reclaim_frames(count)) {
+      break;
+    }
+  }
   assert(0);
   return NULL;
 }
 
+// Like get_frame() but gives up instead of reclaiming memory. For
+// allocations that are nice to have, such as readahead.
+void *try_get_frame(void) {
+  return find_free_frames(true, 1);
+}
+
 void allocate_next_pt(void *address);
 
 void *heap_end;
@@ -150,15 +215,29 @@ void *mmu_find_free_virtual_region(size_t length) {
   return NULL;
 }
 
-void *mmu_map_frames(void *src, size_t length) {
-  void *virtual = mmu_find_free_virtual_region(length);
-
-  uintptr_t p = (uintptr_t)src;
-  for (size_t i = 0; i < length; i += PAGE_SIZE) {
-    assert(check_virtual_region_is_free((void *)((uintptr_t) virtual + i), NULL,
-                                        true, true, (void *)p));
-    p += PAGE_SIZE;
+// Maps the frames starting at `physical` to a free region of the kernel
+// heap. Another core may map part of the region first, then what was
+// mapped so far is dropped and the search goes on past it.
+static void *map_free_region(void *physical, size_t length) {
+  for (;;) {
+    void *virtual = mmu_find_free_virtual_region(length);
+    size_t i = 0;
+    for (; i < length; i += PAGE_SIZE) {
+      if (!check_virtual_region_is_free((void *)((uintptr_t) virtual + i),
+                                        NULL, true, true,
+                                        (void *)((uintptr_t)physical + i))) {
+        break;
+      }
+    }
+    if (i >= length) {
+      return virtual;
+    }
+    mmu_unmap_frames(virtual, i);
   }
+}
+
+void *mmu_map_frames(void *src, size_t length) {
+  void *virtual = map_free_region(src, length);
 
   uintptr_t offset = (uintptr_t)src & 0xFFF;
   virtual = (void *)((uintptr_t) virtual + offset);
@@ -185,6 +264,36 @@ uintptr_t *get_page(void *src) {
               ->page[pt_index];
 }
 
+// Same as get_page() but returns NULL if any of the tables leading up
+// to the page do not exist.
+static uintptr_t *find_page(void *src) {
+  uintptr_t address = (uintptr_t)src;
+  const int PT_SHIFT = 12;
+  const int PDT_SHIFT = 12 + 9 * 1;
+  const int PDPT_SHIFT = 12 + 9 * 2;
+  const int PML4_SHIFT = 12 + 9 * 3;
+
+  uint64_t pml4t_index = ((uintptr_t)address >> PML4_SHIFT) & 0x1FF;
+  uint64_t pdpt_index = ((uintptr_t)address >> PDPT_SHIFT) & 0x1FF;
+  uint64_t pdt_index = ((uintptr_t)address >> PDT_SHIFT) & 0x1FF;
+  uint64_t pt_index = ((uintptr_t)address >> PT_SHIFT) & 0x1FF;
+
+  struct mmu_directory *directory = mmu_get_active_directory();
+
+  if (!(directory->pml4t->physical[pml4t_index] & PAGE_FLAG_PRESENT)) {
+    return NULL;
+  }
+  struct PDPT *pdpt = directory->pml4t->pdpt[pml4t_index];
+  if (!(pdpt->physical[pdpt_index] & PAGE_FLAG_PRESENT)) {
+    return NULL;
+  }
+  struct PDT *pdt = pdpt->pdt[pdpt_index];
+  if (!(pdt->physical[pdt_index] & PAGE_FLAG_PRESENT)) {
+    return NULL;
+  }
+  return &pdt->pt[pdt_index]->page[pt_index];
+}
+
 void mmu_unmap_frames(void *src, size_t length) {
   uintptr_t p = (uintptr_t)src;
   for (size_t i = 0; i < length; i += PAGE_SIZE) {
@@ -197,6 +306,54 @@ void mmu_unmap_frames(void *src, size_t length) {
   flush_tlb();
 }
 
+// Backs the page aligned region with newly allocated frames.
+void mmu_map_pages(void *address, size_t length) {
+  for (size_t i = 0; i < length; i += PAGE_SIZE) {
+    assert(check_virtual_region_is_free((void *)((uintptr_t)address + i), NULL,
+                                        true, false, NULL));
+  }
+}
+
+// Unmaps the region and gives back the frames that were behind it. The
+// frames are only released once no core can reach them anymore.
+void mmu_unmap_pages(void *address, size_t length) {
+  for (size_t i = 0; i < length; i += PAGE_SIZE) {
+    uintptr_t *page = get_page((void *)((uintptr_t)address + i));
+    assert(*page & PAGE_FLAG_PRESENT);
+    *page &= ~PAGE_FLAG_PRESENT;
+  }
+  tlb_shootdown();
+  for (size_t i = 0; i < length; i += PAGE_SIZE) {
+    uintptr_t *page = get_page((void *)((uintptr_t)address + i));
+    mmu_frame_release((void *)(*page & ~(0xFFF)));
+    *page = (uintptr_t)NULL;
+  }
+}
+
+// Maps the region to the physically contiguous frames at `physical`.
+void mmu_map_physical(void *address, void *physical, size_t length) {
+  for (size_t i = 0; i < length; i += PAGE_SIZE) {
+    assert(check_virtual_region_is_free((void *)((uintptr_t)address + i), NULL,
+                                        true, true,
+                                        (void *)((uintptr_t)physical + i)));
+  }
+}
+
+// Moves the frames behind the region to `dst`, which has to be
+// unmapped. Nothing is copied.
+void mmu_move_pages(void *src, void *dst, size_t length) {
+  for (size_t i = 0; i < length; i += PAGE_SIZE) {
+    uintptr_t *page = get_page((void *)((uintptr_t)src + i));
+    assert(*page & PAGE_FLAG_PRESENT);
+    void *frame = (void *)(*page & ~(0xFFF));
+    assert(check_virtual_region_is_free((void *)((uintptr_t)dst + i), NULL,
+                                        true, true, frame));
+    *page = (uintptr_t)NULL;
+  }
+  // The old addresses may be used again once this returns.
+  tlb_shootdown();
+}
+
 // FIXME: WARNING: The allocation is not guaranteed to be linear in the
 // physical memory mapping.
 void *ksbrk_physical(size_t length, void **physical) {
@@ -237,7 +394,6 @@ void *ksbrk_physical(size_t length, void **physical) {
     *physical = r;
   }
 
-  prng_get_pseudorandom(rc, align_up(length, PAGE_SIZE));
   return rc;
 }
 
@@ -300,60 +456,58 @@ void *mmu_virtual_to_physical(void *address, bool *exists) {
 
 void *safe_allocation(size_t length, void **physical) {
   void *p = get_frame(true, (align_up(length, PAGE_SIZE)) / PAGE_SIZE);
-  void *a = mmu_find_free_virtual_region(length);
+  void *a = map_free_region(p, length);
 
   if (physical) {
     *physical = p;
   }
-
-  uintptr_t ptr = (uintptr_t)a;
-  uintptr_t phys_ptr = (uintptr_t)p;
-  for (size_t i = 0; i < length / PAGE_SIZE; i++) {
-    assert(check_virtual_region_is_free((void *)ptr, NULL, true, true,
-                                        (void *)phys_ptr));
-    phys_ptr += PAGE_SIZE;
-    ptr += PAGE_SIZE;
-  }
   memset(a, 0, align_up(length, PAGE_SIZE));
   return a;
 }
 
-bool allocate_pt(u64 pml4t_index, u64 pdpt_index, u64 pdt_index) {
-  struct mmu_directory *directory = mmu_get_active_directory();
+// Serialises installing page tables. The tables are allocated before it
+// is taken since getting frames may reclaim memory, which sleeps.
+lock_t pt_lock;
 
-  // kprintf("pml4t_index: %d\n", pml4t_index);
-  // kprintf("directory: %x\n", directory);
-  if (!(directory->pml4t->physical[pml4t_index] & PAGE_FLAG_PRESENT)) {
-    void *physical;
-    struct PDPT *pdpt = safe_allocation(sizeof(struct PDPT), &physical);
-    directory->pml4t->physical[pml4t_index] = (uintptr_t)physical | 0x3;
-    directory->pml4t->pdpt[pml4t_index] = pdpt;
+// Allocates a table of `size` bytes for `entry` unless it is present
+// and installs it, `table` is where the virtual address of it is kept.
+// Returns false if another core installed one first.
+static bool install_table(uintptr_t *entry, void **table, size_t size) {
+  if (atomic_load_acquire(entry) & PAGE_FLAG_PRESENT) {
+    return false;
   }
+  void *physical;
+  void *address = safe_allocation(size, &physical);
 
-  if (!(directory->pml4t->pdpt[pml4t_index]->physical[pdpt_index] &
-        PAGE_FLAG_PRESENT)) {
-    void *physical;
-    struct PDT *pdt = safe_allocation(sizeof(struct PDT), &physical);
-    directory->pml4t->pdpt[pml4t_index]->physical[pdpt_index] =
-        (uintptr_t)physical | 0x3;
-    directory->pml4t->pdpt[pml4t_index]->pdt[pdpt_index] = pdt;
+  lock_acquire(&pt_lock);
+  bool installed = !(*entry & PAGE_FLAG_PRESENT);
+  if (installed) {
+    // Anyone that finds the entry present may follow the pointer.
+    *table = address;
+    atomic_store_release(entry, (uintptr_t)physical | 0x3);
   }
+  lock_release(&pt_lock);
 
-  if ((directory->pml4t->pdpt[pml4t_index]
-           ->pdt[pdpt_index]
-           ->physical[pdt_index] &
-       PAGE_FLAG_PRESENT)) {
-    return false;
+  if (!installed) {
+    mmu_unmap_pages(address, size);
   }
+  return installed;
+}
 
-  void *physical;
-  void *address = safe_allocation(sizeof(struct PT), &physical);
+bool allocate_pt(u64 pml4t_index, u64 pdpt_index, u64 pdt_index) {
+  struct mmu_directory *directory = mmu_get_active_directory();
 
-  directory->pml4t->pdpt[pml4t_index]->pdt[pdpt_index]->physical[pdt_index] =
-      (uintptr_t)physical | 0x3;
-  directory->pml4t->pdpt[pml4t_index]->pdt[pdpt_index]->pt[pdt_index] = address;
+  struct PML4T *pml4t = directory->pml4t;
+  install_table(&pml4t->physical[pml4t_index],
+                (void **)&pml4t->pdpt[pml4t_index], sizeof(struct PDPT));
 
-  return true;
+  struct PDPT *pdpt = pml4t->pdpt[pml4t_index];
+  install_table(&pdpt->physical[pdpt_index], (void **)&pdpt->pdt[pdpt_index],
+                sizeof(struct PDT));
+
+  struct PDT *pdt = pdpt->pdt[pdpt_index];
+  return install_table(&pdt->physical[pdt_index], (void **)&pdt->pt[pdt_index],
+                       sizeof(struct PT));
 }
 
 void allocate_next_pt(void *address) {
@@ -422,16 +576,23 @@ bool check_virtual_region_is_free(void *address, void **physical, bool allocate,
                  ->pt[pdt_index]
                  ->page[pt_index];
 
-  if (!(((uintptr_t)*p) & PAGE_FLAG_PRESENT)) {
+  uintptr_t entry = atomic_load_relaxed((uintptr_t *)p);
+  if (!(entry & PAGE_FLAG_PRESENT)) {
     // Region does not exist and we allocate it.
     if (allocate) {
       if (!use_frame) {
         frame = get_frame(true, 1);
       }
-      *p = frame;
-      *p = (void *)((uintptr_t)*p | 0x3);
+      // Another core may map the same address in the meantime.
+      if (!atomic_cmpxchg_seq_cst((uintptr_t *)p, &entry,
+                                  (uintptr_t)frame | 0x3)) {
+        if (!use_frame) {
+          mmu_frame_release(frame);
+        }
+        return false;
+      }
       if (physical) {
-        *physical = (void *)((uintptr_t)(*p) & ~(0xFFF));
+        *physical = (void *)((uintptr_t)frame & ~(0xFFF));
       }
 
       return true;
@@ -511,6 +672,81 @@ void copy_frame(void *physical_dst, void *physical_src) {
   mmu_unmap_frames(src, PAGE_SIZE);
 }
 
+// Walks the page tables of `directory` looking for the first present
+// page in the range [*cursor, end). Addresses are 48 bit linear
+// addresses, i.e. without the sign extension. If one is found *cursor
+// is set to its address and the page entry is returned.
+uintptr_t *mmu_next_present_page(struct mmu_directory *directory,
+                                 uintptr_t *cursor, uintptr_t end) {
+  const int PT_SHIFT = 12;
+  const int PDT_SHIFT = 12 + 9 * 1;
+  const int PDPT_SHIFT = 12 + 9 * 2;
+  const int PML4_SHIFT = 12 + 9 * 3;
+
+  uintptr_t address = *cursor & ~(0xFFF);
+  for (; address < end;) {
+    uint64_t pml4t_index = (address >> PML4_SHIFT) & 0x1FF;
+    uint64_t pdpt_index = (address >> PDPT_SHIFT) & 0x1FF;
+    uint64_t pdt_index = (address >> PDT_SHIFT) & 0x1FF;
+    uint64_t pt_index = (address >> PT_SHIFT) & 0x1FF;
+
+    if (!(directory->pml4t->physical[pml4t_index] & PAGE_FLAG_PRESENT)) {
+      address = (address | (((uintptr_t)1 << PML4_SHIFT) - 1)) + 1;
+      continue;
+    }
+    struct PDPT *pdpt = directory->pml4t->pdpt[pml4t_index];
+    if (!(pdpt->physical[pdpt_index] & PAGE_FLAG_PRESENT)) {
+      address = (address | (((uintptr_t)1 << PDPT_SHIFT) - 1)) + 1;
+      continue;
+    }
+    struct PDT *pdt = pdpt->pdt[pdpt_index];
+    if (!(pdt->physical[pdt_index] & PAGE_FLAG_PRESENT)) {
+      address = (address | (((uintptr_t)1 << PDT_SHIFT) - 1)) + 1;
+      continue;
+    }
+    uintptr_t *page = &pdt->pt[pdt_index]->page[pt_index];
+    if (*page & PAGE_FLAG_PRESENT) {
+      *cursor = address;
+      return page;
+    }
+    address += PAGE_SIZE;
+  }
+  *cursor = end;
+  return NULL;
+}
+
+// Returns true if the fault was caused by a copy-on-write page or a
+// page that had been moved out of memory and has been resolved.
+bool mmu_handle_page_fault(void *address, u64 error_code) {
+  uintptr_t *page = find_page(address);
+  if (!page) {
+    return false;
+  }
+  if (!(error_code & PAGE_FAULT_PRESENT)) {
+    if (!(*page & PAGE_FLAG_SWAPPED)) {
+      return false;
+    }
+    return reclaim_fault_in(page);
+  }
+  if (!(error_code & PAGE_FAULT_WRITE) || !(*page & PAGE_FLAG_COW)) {
+    return false;
+  }
+  void *frame = (void *)(*page & ~(0xFFF));
+  uintptr_t flags = (*page & 0xFFF & ~PAGE_FLAG_COW) | PAGE_FLAG_WRITABLE;
+
+  if (0 == mmu_frame_references(frame)) {
+    // Every other mapping has already made its own copy.
+    *page = (uintptr_t)frame | flags;
+  } else {
+    void *new_frame = get_frame(true, 1);
+    copy_frame(new_frame, frame);
+    *page = (uintptr_t)new_frame | flags;
+    mmu_frame_release(frame);
+  }
+  flush_tlb();
+  return true;
+}
+
 bool clone_pt(struct PT *orig_pt, struct PT **new_pt, void **physical) {
   *new_pt = safe_allocation(sizeof(struct PT), physical);
 
@@ -591,7 +827,7 @@ struct mmu_directory *mmu_clone_directory(struct mmu_directory *directory) {
 void set_cr3(void *cr3);
 
 void mmu_set_directory(struct mmu_directory *directory) {
-  kernel_threads[core_id_get()].active_directory = directory;
+  this_cpu_write(active_directory, directory);
   set_cr3(directory->physical);
 }
 
@@ -602,21 +838,12 @@ void mmu_remove_identity(void) {
 }
 
 struct mmu_directory *mmu_get_active_directory(void) {
-  return kernel_threads[core_id_get()].active_directory;
+  return this_cpu_read(active_directory);
 }
 
 void set_stack_and_jump(void *, void *);
 void mmu_init_for_new_core(void (*main)(void)) {
-  // Since we currently have no idea what the bootstrapping core is,
-  // search through the kernel_threads, find a valid directory and use
-  // that as the base.
-  struct mmu_directory *base_directory = NULL;
-  for (int i = 0; i < MAX_CORES; i++) {
-    base_directory = kernel_threads[i].active_directory;
-    if (base_directory) {
-      break;
-    }
-  }
+  struct mmu_directory *base_directory = kernel_directory;
   assert(base_directory);
 
   // Set the directory now so we can do allocations
@@ -639,7 +866,8 @@ void mmu_init_for_new_core(void (*main)(void)) {
 
 int mmu_init(void *multiboot_header) {
   struct mmu_directory *active_directory = &orig_active_directory;
-  kernel_threads[core_id_get()].active_directory = active_directory;
+  this_cpu_write(active_directory, active_directory);
+  kernel_directory = active_directory;
 
   active_directory->pml4t =
       (struct PML4T *)(((uintptr_t)&PML4T) + 0xffffff8000000000);
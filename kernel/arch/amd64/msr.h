@@ -76,4 +76,6 @@ u64 msr_get(u32 msr);
 void msr_set(u32 msr, u64 value);
 u64 rdtsc(void);
 void cpuid(u32 eax, struct cpuid_values *values);
+// For leaves with sub-leafs, which are selected by ecx.
+void cpuid_count(u32 eax, u32 ecx, struct cpuid_values *values);
 u64 msr_is_available(void);
@@ -16,6 +16,24 @@ cpuid:
 	pop rbx
 	ret
 
+; u32 leaf, u32 subleaf, struct cpuid_values *values
+global cpuid_count
+cpuid_count:
+	push rbx ; CPUID modifies rbx
+
+	mov r8, rdx
+	mov rax, rdi
+	mov rcx, rsi
+	cpuid
+
+	mov [r8+0], eax
+	mov [r8+4*1], ebx
+	mov [r8+4*2], ecx
+	mov [r8+4*3], edx
+
+	pop rbx
+	ret
+
 global msr_is_available
 msr_is_available:
 	push rbx ; CPUID modifies rbx
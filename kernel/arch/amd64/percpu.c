@@ -0,0 +1,18 @@
+#include <arch/amd64/msr.h>
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/smp.h>
+
+#define MSR_GS_BASE 0xC0000101
+
+u32 cpu_count = 1;
+struct percpu percpu_boot;
+
+// Called once on every core before anything else, the locks keep the
+// preempt count in the per-CPU area. Nothing loads the GS selector
+// afterwards, which would clear the base again.
+void percpu_init(struct percpu *cpu, u32 cpu_id) {
+  cpu->self = cpu;
+  cpu->cpu_id = cpu_id;
+  cpu->apic_id = apic_id_get();
+  msr_set(MSR_GS_BASE, (u64)cpu);
+}
@@ -0,0 +1,37 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+#include <typedefs.h>
+
+struct mmu_directory;
+struct task;
+
+// State of one core. IA32_GS_BASE points at the core's own area, so
+// finding it is a single gs relative load instead of the cpuid it
+// took before. Only the owning core writes to its area.
+struct percpu {
+  // this_cpu() loads it, has to stay first.
+  struct percpu *self;
+  // Logical number, from 0 to cpu_count - 1.
+  u32 cpu_id;
+  u32 apic_id;
+  u32 preempt_count;
+  u32 irq_depth;
+  struct mmu_directory *active_directory;
+  struct task *current_task;
+} __attribute__((aligned(64)));
+
+struct percpu *this_cpu(void);
+
+#define this_cpu_read(field) (this_cpu()->field)
+#define this_cpu_write(field, value) (this_cpu()->field = (value))
+// Not atomic. Fine for counts that interrupt handlers leave balanced,
+// others have to be changed with interrupts disabled.
+#define this_cpu_add(field, value) (this_cpu()->field += (value))
+
+// Number of cores, only 1 until smp_enumerate() has run.
+extern u32 cpu_count;
+// Area of the BSP, which needs one before the heap is set up.
+extern struct percpu percpu_boot;
+
+void percpu_init(struct percpu *cpu, u32 cpu_id);
+#endif // PERCPU_H
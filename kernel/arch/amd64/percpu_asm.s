@@ -0,0 +1,8 @@
+section .text
+
+; Returns the per-CPU area of the current core, IA32_GS_BASE points at
+; it and its first field points back at itself.
+global this_cpu
+this_cpu:
+	mov rax, [gs:0]
+	ret
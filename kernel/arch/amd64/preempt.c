@@ -0,0 +1,43 @@
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/preempt.h>
+#include <assert.h>
+#include <atomic.h>
+
+// Nesting counts of the current core, kept in its per-CPU area.
+// `preempt_count` is raised by code that must not be switched away
+// from, every lock_t and mcs_lock does so while it is held.
+// `irq_depth` is the number of interrupt handlers currently running on
+// the core. The timer only switches tasks when both are zero, apart
+// from its own interrupt.
+
+void preempt_disable(void) {
+  this_cpu_add(preempt_count, 1);
+  compiler_barrier();
+}
+
+void preempt_enable(void) {
+  compiler_barrier();
+  assert(this_cpu_read(preempt_count) > 0);
+  this_cpu_add(preempt_count, -1);
+}
+
+u32 preempt_count(void) {
+  return this_cpu_read(preempt_count);
+}
+
+void irq_enter(void) {
+  this_cpu_add(irq_depth, 1);
+}
+
+void irq_exit(void) {
+  assert(this_cpu_read(irq_depth) > 0);
+  this_cpu_add(irq_depth, -1);
+}
+
+u32 irq_depth(void) {
+  return this_cpu_read(irq_depth);
+}
+
+bool in_interrupt(void) {
+  return irq_depth() > 0;
+}
@@ -0,0 +1,13 @@
+#ifndef PREEMPT_H
+#define PREEMPT_H
+#include <stdbool.h>
+#include <typedefs.h>
+
+void preempt_disable(void);
+void preempt_enable(void);
+u32 preempt_count(void);
+void irq_enter(void);
+void irq_exit(void);
+u32 irq_depth(void);
+bool in_interrupt(void);
+#endif // PREEMPT_H
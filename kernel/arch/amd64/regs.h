@@ -1,3 +1,4 @@
 #include <typedefs.h>
 
 u64 get_cr3(void);
+u64 get_cr2(void);
@@ -1,5 +1,10 @@
 global get_cr3
+global get_cr2
 
 get_cr3:
 	mov rax, cr3
 	ret
+
+get_cr2:
+	mov rax, cr2
+	ret
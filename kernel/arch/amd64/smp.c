@@ -1,14 +1,24 @@
+#include <arch/amd64/apic.h>
+#include <arch/amd64/idt.h>
 #include <arch/amd64/msr.h>
 #include <arch/amd64/regs.h>
 #include <arch/amd64/smp.h>
+#include <arch/amd64/tlb.h>
 #include <assert.h>
+#include <atomic.h>
+#include <completion.h>
+#include <ebr.h>
+#include <kmalloc.h>
 #include <kprintf.h>
-#include <lock.h>
+#include <mm/ksm.h>
 #include <mmu.h>
+#include <rcu.h>
 #include <string.h>
 #include <typedefs.h>
 
-lock_t smp_lock;
+// Completed by every core once it is up, the BSP starts one core at a
+// time since they share the trampoline stack.
+struct completion smp_core_started;
 
 struct ACPISDTHeader {
   char Signature[4];
@@ -27,17 +37,29 @@ struct RSDT {
   uint32_t PointerToOtherSDT[0]; // (h.Length - sizeof(h)) / 4;
 } __attribute__((packed));
 
+#define MADT_LOCAL_APIC 0
+#define MADT_LOCAL_X2APIC 9
+#define MADT_APIC_ENABLED (1 << 0)
+
 struct processor_local_apic {
   u8 apic_processor_id;
   u8 apic_id;
   u32 flags;
 } __attribute__((packed));
 
+struct processor_local_x2apic {
+  u16 reserved;
+  u32 x2apic_id;
+  u32 flags;
+  u32 acpi_processor_uid;
+} __attribute__((packed));
+
 struct madt_entry {
   u8 entry_type;
   u8 record_length;
   union {
     struct processor_local_apic local_apic;
+    struct processor_local_x2apic local_x2apic;
   };
 };
 
@@ -64,8 +86,6 @@ bool rsdp_checksum(u8 *src, size_t size) {
   return (0 == r);
 }
 
-u8 *lapic_ptr = NULL;
-
 void mdelay(int s) {
   (void)s;
   //  for (int i = 0; i < 10000; i++) {
@@ -81,78 +101,77 @@ void udelay(int s) {
 }
 
 // void ap_trampoline();
-volatile u8 bspdone = 0;
-volatile uint8_t aprunning = 0; // count how many APs have started
-extern volatile u32 trampoline_cr3;
+extern u32 trampoline_cr3;
+
+// Logical CPU number to APIC ID, the BSP is CPU 0.
+u32 *cpu_apic_ids = NULL;
 
-void wait_for_delivery(volatile u32 *);
+// Handed to the core that is being started.
+struct percpu *smp_starting_cpu = NULL;
+u32 smp_starting_id = 0;
 
-u8 bspid_get(void) {
+u32 apic_id_get(void) {
   struct cpuid_values values;
+  cpuid(0, &values);
+  if (values.eax >= 0xB) {
+    // Some CPUs report leaf 0xB as available without implementing it,
+    // it then returns zeroes.
+    cpuid_count(0xB, 0, &values);
+    if (0 != values.ebx) {
+      return values.edx;
+    }
+  }
   cpuid(1, &values);
   return values.ebx >> 24;
 }
 
 void flush_tlb(void);
-void enable_core(int core) {
+void enable_core(u32 cpu) {
+  u32 apic_id = cpu_apic_ids[cpu];
+  if (apic_id == this_cpu_read(apic_id)) {
+    return;
+  }
 
-  uint8_t bspid = bspid_get(); // BSP id and spinlock flag
-                               // get the BSP's Local APIC ID
+  struct percpu *area = kmalloc(sizeof(struct percpu));
+  if (!area) {
+    kprintf("[NOTE] No memory to start core %d\n", cpu);
+    return;
+  }
+  memset(area, 0, sizeof(struct percpu));
 
   uint64_t cr3 = get_cr3();
   // uint64_t cr3;
   //__asm__ __volatile__("mov %%cr3, %%rbx" : "=b"(cr3) : :);
 
-  volatile u32 *ptr = (u32 *)((uintptr_t)&trampoline_cr3 + 0xFFFFFF8000000000);
-
-  *ptr = cr3;
+  u32 *ptr = (u32 *)((uintptr_t)&trampoline_cr3 + 0xFFFFFF8000000000);
+  atomic_store_relaxed(ptr, cr3);
   kprintf("*ptr: %x\n", *ptr);
   kprintf("cr3: %x\n", cr3);
-  //  for (;;)
-  //    ;
-
-  int i = core;
-  kprintf("bspid: %d\n", bspid);
-  // do not start BSP, that's already running this code
-  // #if 0
-  if (core == bspid) { // FIXME: Incorrect
-    kprintf("CORE Already in use\n");
+
+  smp_starting_id = cpu;
+  atomic_store_release(&smp_starting_cpu, area);
+  // Writing the ICR through an MSR in x2APIC mode is not serializing,
+  // the core must not start before it can see the stores above.
+  atomic_fence_seq_cst();
+
+  // send INIT IPI
+  apic_write_register(APIC_ERROR_STATUS, 0);
+  if (!apic_send_ipi(apic_id, APIC_IPI_INIT)) {
+    kprintf("[NOTE] Can not address core %d with APIC ID %x\n", cpu,
+            apic_id);
+    kfree(area);
     return;
   }
-  lock_acquire(&smp_lock);
-  // #endif
-  //   send INIT IPI
-
-  // FIXME: Give correct names
-  volatile u32 *apic_errors = (volatile uint32_t *)(lapic_ptr + 0x280);
-  volatile u32 *apic_select = (volatile uint32_t *)(lapic_ptr + 0x310);
-  volatile u32 *apic_trigger = (volatile uint32_t *)(lapic_ptr + 0x300);
-
-  *apic_errors = 0;
-
-  *apic_select = *apic_select | (i << 24);
-  *apic_trigger = (*apic_trigger & 0xfff00000) | 0x00C500;
-
-  wait_for_delivery(apic_trigger);
-
-  *apic_select = *apic_select | (i << 24);
-  *apic_trigger = (*apic_trigger & 0xfff00000) | 0x008500;
-
-  wait_for_delivery(apic_trigger);
+  apic_send_ipi(apic_id, APIC_IPI_INIT_DEASSERT);
 
   mdelay(10);
   // send STARTUP IPI (twice)
   for (int j = 0; j < 2; j++) {
-    *apic_errors = 0;
-    *apic_select = *apic_select | (i << 24);
-    *apic_trigger = (*apic_trigger & 0xfff0f800) | 0x000608;
-
+    apic_write_register(APIC_ERROR_STATUS, 0);
+    apic_send_ipi(apic_id, APIC_IPI_STARTUP);
     udelay(200); // wait 200 usec
-    wait_for_delivery(apic_trigger);
   }
-  // release the AP spinlocks
-  bspdone = 1;
-  // now you'll have the number of running APs in 'aprunning'
+  wait_for_completion(&smp_core_started);
 }
 
 bool rsdt_find_signature(struct RSDT *rsdt, char *signature, void **out) {
@@ -176,29 +195,34 @@ bool rsdt_find_signature(struct RSDT *rsdt, char *signature, void **out) {
 
 void enable_core_asm(u64 rdi);
 
-u8 core_id_get(void) {
-  return bspid_get();
-}
-
 void core_main() {
-  lock_release(&smp_lock);
+  complete(&smp_core_started);
   mmu_remove_identity();
 
   kprintf("CORE MAIN\n");
-  for (;;)
-    ;
+  apic_enable_core();
+  idt_init_core();
+  tlb_cpu_online();
+  rcu_cpu_online();
+  for (;;) {
+    rcu_quiescent_state();
+    ebr_collect();
+    ksm_scan_periodic();
+    cpu_relax();
+  }
 }
 
 void gdt_init();
 void ap_startup() {
-  kprintf("\nap_startup bspid: %d\n", bspid_get());
+  percpu_init(atomic_load_acquire(&smp_starting_cpu), smp_starting_id);
+  kprintf("\nap_startup apic id: %x\n", apic_id_get());
   gdt_init();
   mmu_init_for_new_core(core_main);
   for (;;)
     ;
 }
 
-void smp_init(struct multiboot_tag *tags) {
+static struct MADT *smp_find_madt(struct multiboot_tag *tags) {
   for (struct multiboot_tag *tag = tags; tag->type != MULTIBOOT_TAG_TYPE_END;
        tag = (struct multiboot_tag *)((multiboot_uint8_t *)tag +
                                       ((tag->size + 7) & ~7))) {
@@ -233,19 +257,66 @@ void smp_init(struct multiboot_tag *tags) {
     assert(rsdt_find_signature(header, "APIC", (void **)&madt));
     kprintf("MADT Signature: %.*s\n", 4, madt->h.Signature);
     kprintf("Local APIC: %p\n", madt->local_apic_address);
-    // lapic_ptr
-    lapic_ptr = mmu_map_frames((void *)madt->local_apic_address, 0x1000);
-
-    for (struct madt_entry *p = madt->entries;
-         ((uintptr_t)p - (uintptr_t)madt) < madt->h.Length;) {
-      kprintf("entry_type: %x\n", p->entry_type);
-      if (0 == p->entry_type) {
-        kprintf("id: %x\n", p->local_apic.apic_processor_id);
-        enable_core(p->local_apic.apic_processor_id);
-      }
-
-      p = (struct madt_entry *)((uintptr_t)p + p->record_length);
+    return madt;
+  }
+  return NULL;
+}
+
+// Returns false for entries that are not a usable core.
+static bool madt_entry_apic_id(struct madt_entry *p, u32 *apic_id) {
+  if (MADT_LOCAL_APIC == p->entry_type) {
+    *apic_id = p->local_apic.apic_id;
+    return (p->local_apic.flags & MADT_APIC_ENABLED);
+  }
+  if (MADT_LOCAL_X2APIC == p->entry_type) {
+    *apic_id = p->local_x2apic.x2apic_id;
+    return (p->local_x2apic.flags & MADT_APIC_ENABLED);
+  }
+  return false;
+}
+
+#define MADT_FOR_EACH_ENTRY(madt, p)                                           \
+  for (struct madt_entry *p = (madt)->entries;                                 \
+       ((uintptr_t)p - (uintptr_t)(madt)) < (madt)->h.Length;                  \
+       p = (struct madt_entry *)((uintptr_t)p + p->record_length))
+
+// Numbers the cores listed in the MADT, the BSP first. Runs before the
+// heap is set up so that everything per CPU can be sized by cpu_count.
+bool smp_enumerate(struct multiboot_tag *tags) {
+  struct MADT *madt = smp_find_madt(tags);
+  if (!madt) {
+    return false;
+  }
+
+  u32 count = 1;
+  MADT_FOR_EACH_ENTRY(madt, p) {
+    u32 apic_id;
+    if (madt_entry_apic_id(p, &apic_id)) {
+      count++;
+    }
+  }
+
+  u32 *ids = ksbrk(count * sizeof(u32));
+  if (!ids) {
+    return false;
+  }
+  u32 n = 0;
+  ids[n++] = this_cpu_read(apic_id);
+  MADT_FOR_EACH_ENTRY(madt, p) {
+    u32 apic_id;
+    if (madt_entry_apic_id(p, &apic_id) && apic_id != ids[0]) {
+      kprintf("core %d: apic id: %x\n", n, apic_id);
+      ids[n++] = apic_id;
     }
   }
-  lock_acquire(&smp_lock);
+  cpu_apic_ids = ids;
+  cpu_count = n;
+  return true;
+}
+
+// Starts every core found by smp_enumerate().
+void smp_init(void) {
+  for (u32 i = 1; i < cpu_count; i++) {
+    enable_core(i);
+  }
 }
@@ -1,5 +1,13 @@
+#ifndef SMP_H
+#define SMP_H
 #include "multiboot2.h"
+#include <arch/amd64/percpu.h>
+#include <stdbool.h>
 #include <typedefs.h>
 
-void smp_init(struct multiboot_tag *tags);
-u8 core_id_get(void);
+bool smp_enumerate(struct multiboot_tag *tags);
+void smp_init(void);
+u32 apic_id_get(void);
+// Only valid after percpu_init().
+#define core_id_get() this_cpu_read(cpu_id)
+#endif // SMP_H
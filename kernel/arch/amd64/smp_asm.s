@@ -1,13 +1,3 @@
-section .text
-
-global wait_for_delivery
-wait_for_delivery:
-.loop:
-	pause
-	cmp DWORD [rdi], (1<<12)
-	jz .loop
-	ret
-
 section .trampoline.bss
 global trampoline_gdt
 align 64
@@ -79,8 +69,8 @@ ap_stage2:
     or eax, 1 << 8
     wrmsr
 
-	; Enable long mode
-	mov ebx, 0x80000011
+	; Enable long mode(and CR0.WP for copy-on-write)
+	mov ebx, 0x80010011
 	mov cr0, ebx
 
     lgdt [GDT2.Pointer]
@@ -0,0 +1,102 @@
+#include <arch/amd64/apic.h>
+#include <arch/amd64/idt.h>
+#include <arch/amd64/preempt.h>
+#include <arch/amd64/smp.h>
+#include <arch/amd64/tlb.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <stddef.h>
+
+// Pages unmapped by one core may still be cached in the TLB of others.
+// Before their frames or their addresses are used again every core has
+// to flush, tlb_shootdown() asks the others with an IPI and waits until
+// they have.
+//
+// Shootdowns are numbered by `tlb_generation` and every core records
+// the newest one it has flushed for. A core waiting for the others
+// keeps flushing for newer ones itself, so two cores shooting down at
+// the same time with interrupts disabled do not wait for each other.
+//
+// Only the local TLB is flushed until tlb_init() has run, and cores
+// are only asked once they take interrupts.
+
+struct tlb_cpu {
+  u64 flushed;
+  bool online;
+} CACHE_LINE_ALIGNED;
+
+void flush_tlb(void);
+extern u32 *cpu_apic_ids;
+
+u64 tlb_generation = 0;
+// cpu_count entries.
+struct tlb_cpu *tlb_cpus = NULL;
+
+// Flushes if there was a shootdown since the last flush of this core.
+static void tlb_flush_pending(void) {
+  u64 flags = interrupts_save_disable();
+  struct tlb_cpu *cpu = &tlb_cpus[core_id_get()];
+  u64 generation = atomic_load_seq_cst(&tlb_generation);
+  if (atomic_load_relaxed(&cpu->flushed) != generation) {
+    flush_tlb();
+    atomic_store_release(&cpu->flushed, generation);
+  }
+  interrupts_restore(flags);
+}
+
+static void tlb_interrupt(struct cpu_status *r) {
+  (void)r;
+  tlb_flush_pending();
+  apic_eoi();
+}
+
+// Has to run after idt_init().
+bool tlb_init(void) {
+  tlb_cpus = kcalloc(cpu_count, sizeof(struct tlb_cpu));
+  if (!tlb_cpus) {
+    return false;
+  }
+  handler_install(TLB_SHOOTDOWN_VECTOR, tlb_interrupt);
+  return true;
+}
+
+// Called by every core once it takes interrupts.
+void tlb_cpu_online(void) {
+  u64 flags = interrupts_save_disable();
+  struct tlb_cpu *cpu = &tlb_cpus[core_id_get()];
+  atomic_store_seq_cst(&cpu->online, true);
+  // Read after going online, so a shootdown that did not send it an IPI
+  // is covered by this flush.
+  u64 generation = atomic_load_seq_cst(&tlb_generation);
+  flush_tlb();
+  atomic_store_release(&cpu->flushed, generation);
+  interrupts_restore(flags);
+}
+
+// Makes every core drop the translations of pages unmapped before the
+// call. It may be called with interrupts disabled, but not with a lock
+// held that another core could be spinning on with interrupts disabled.
+void tlb_shootdown(void) {
+  flush_tlb();
+  if (!tlb_cpus) {
+    return;
+  }
+  preempt_disable();
+  u64 generation = atomic_fetch_add_seq_cst(&tlb_generation, 1) + 1;
+  u32 self = core_id_get();
+  for (u32 i = 0; i < cpu_count; i++) {
+    if (i != self && atomic_load_seq_cst(&tlb_cpus[i].online)) {
+      apic_send_ipi(cpu_apic_ids[i], APIC_IPI_FIXED | TLB_SHOOTDOWN_VECTOR);
+    }
+  }
+  for (u32 i = 0; i < cpu_count; i++) {
+    if (i == self || !atomic_load_seq_cst(&tlb_cpus[i].online)) {
+      continue;
+    }
+    for (; atomic_load_acquire(&tlb_cpus[i].flushed) < generation;) {
+      tlb_flush_pending();
+      cpu_relax();
+    }
+  }
+  preempt_enable();
+}
@@ -0,0 +1,11 @@
+#ifndef TLB_H
+#define TLB_H
+#include <stdbool.h>
+
+// Interrupt vector of the shootdown IPI.
+#define TLB_SHOOTDOWN_VECTOR 0xF0
+
+bool tlb_init(void);
+void tlb_cpu_online(void);
+void tlb_shootdown(void);
+#endif // TLB_H
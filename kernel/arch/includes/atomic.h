@@ -0,0 +1,115 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+#include <stdbool.h>
+
+// Atomic operations on plain integers and pointers. Every operation
+// names its memory order, so a full barrier is never paid for by
+// accident:
+//
+//   relaxed  only the operation itself is atomic
+//   acquire  later accesses can not move before it, for taking a lock
+//            or reading a flag that guards data
+//   release  earlier accesses can not move after it, for dropping a
+//            lock or publishing data
+//   seq_cst  all seq_cst operations happen in one order that every core
+//            agrees on, only needed when a core has to see the store of
+//            another before its own load, as in Dekker style handshakes
+//
+// On amd64 plain loads and stores already have acquire and release
+// semantics, so those only keep the compiler from reordering. Every
+// read-modify-write is a locked instruction whatever the order. Only a
+// seq_cst store or fence costs an mfence.
+
+#define atomic_load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_load_seq_cst(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+#define atomic_store_relaxed(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_store_seq_cst(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+// Return the value from before the operation.
+#define atomic_fetch_add_relaxed(p, v)                                         \
+  __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_fetch_add_acquire(p, v)                                         \
+  __atomic_fetch_add((p), (v), __ATOMIC_ACQUIRE)
+#define atomic_fetch_add_release(p, v)                                         \
+  __atomic_fetch_add((p), (v), __ATOMIC_RELEASE)
+#define atomic_fetch_add_seq_cst(p, v)                                         \
+  __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+#define atomic_fetch_sub_relaxed(p, v)                                         \
+  __atomic_fetch_sub((p), (v), __ATOMIC_RELAXED)
+#define atomic_fetch_sub_acquire(p, v)                                         \
+  __atomic_fetch_sub((p), (v), __ATOMIC_ACQUIRE)
+#define atomic_fetch_sub_release(p, v)                                         \
+  __atomic_fetch_sub((p), (v), __ATOMIC_RELEASE)
+#define atomic_fetch_sub_seq_cst(p, v)                                         \
+  __atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+
+#define atomic_xchg_relaxed(p, v)                                              \
+  __atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_xchg_acquire(p, v)                                              \
+  __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define atomic_xchg_release(p, v)                                              \
+  __atomic_exchange_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_xchg_acq_rel(p, v)                                              \
+  __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_xchg_seq_cst(p, v)                                              \
+  __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+// Stores `desired` if `*p` equals `*expected` and returns true, else
+// returns false and stores the current value in `*expected`. A failed
+// attempt is only ordered as strongly as a load can be. The weak
+// variants may fail spuriously and belong in retry loops.
+#define atomic_cmpxchg_relaxed(p, expected, desired)                           \
+  __atomic_compare_exchange_n((p), (expected), (desired), false,               \
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define atomic_cmpxchg_acquire(p, expected, desired)                           \
+  __atomic_compare_exchange_n((p), (expected), (desired), false,               \
+                              __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define atomic_cmpxchg_release(p, expected, desired)                           \
+  __atomic_compare_exchange_n((p), (expected), (desired), false,               \
+                              __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#define atomic_cmpxchg_acq_rel(p, expected, desired)                           \
+  __atomic_compare_exchange_n((p), (expected), (desired), false,               \
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define atomic_cmpxchg_seq_cst(p, expected, desired)                           \
+  __atomic_compare_exchange_n((p), (expected), (desired), false,               \
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+#define atomic_cmpxchg_weak_relaxed(p, expected, desired)                      \
+  __atomic_compare_exchange_n((p), (expected), (desired), true,                \
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define atomic_cmpxchg_weak_acquire(p, expected, desired)                      \
+  __atomic_compare_exchange_n((p), (expected), (desired), true,                \
+                              __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define atomic_cmpxchg_weak_release(p, expected, desired)                      \
+  __atomic_compare_exchange_n((p), (expected), (desired), true,                \
+                              __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+
+// Fences order the plain and relaxed accesses around them.
+#define atomic_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define atomic_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define atomic_fence_seq_cst() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+// Only keeps the compiler from moving accesses across it, enough
+// against an interrupt handler on the same core.
+#define compiler_barrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+// In every busy wait loop. Tells the core that it is spinning, which
+// saves power and gives the other hyperthread the pipeline.
+#define cpu_relax() __builtin_ia32_pause()
+
+// Data written by different cores should not share a cache line, or
+// every write takes the line away from the other cores.
+#define CACHE_LINE_SIZE 64
+#define CACHE_LINE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+// Pushes the members that follow onto the next cache line:
+//
+//   struct queue {
+//     u64 head;
+//     CACHE_LINE_PAD(pad);
+//     u64 tail;
+//   };
+#define CACHE_LINE_PAD(name) char name[0] CACHE_LINE_ALIGNED
+#endif // ATOMIC_H
@@ -1,6 +1,85 @@
+#ifndef LOCK_H
+#define LOCK_H
 #include <typedefs.h>
 
+// Ticket lock, fair but every waiter spins on the same cache line. Good
+// for locks that are rarely contended.
+//
+// Both kinds of lock raise the preempt count of the core while they are
+// held, so the holder is not switched away from and has to release the
+// lock on the same core. Nothing that sleeps may be called with a lock
+// held.
 typedef u32 lock_t;
 
 void lock_acquire(lock_t *lock);
 void lock_release(lock_t *lock);
+
+// For locks that are also taken by interrupt handlers. Interrupts stay
+// disabled while the lock is held, the returned RFLAGS are passed to
+// the release which enables them again if they were before.
+u64 lock_acquire_irqsave(lock_t *lock);
+void lock_release_irqrestore(lock_t *lock, u64 flags);
+
+// Queued lock for contended locks. Every waiter spins on its own node
+// and the lock is handed over in FIFO order. The node, usually on the
+// stack, has to stay around until the lock is released.
+struct mcs_node {
+  struct mcs_node *next;
+  u32 waiting;
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+  struct mcs_node *tail;
+};
+
+void mcs_lock_acquire(struct mcs_lock *lock, struct mcs_node *node);
+void mcs_lock_release(struct mcs_lock *lock, struct mcs_node *node);
+u64 mcs_lock_acquire_irqsave(struct mcs_lock *lock, struct mcs_node *node);
+void mcs_lock_release_irqrestore(struct mcs_lock *lock, struct mcs_node *node,
+                                 u64 flags);
+#ifdef KERNEL_TEST
+u64 lock_benchmark(u32 rounds);
+#endif // KERNEL_TEST
+
+// Counts acquisitions, contention, wait and hold cycles for every place
+// a lock is taken, see lockstat_dump(). Costs two rdtsc and a few
+// atomics per lock operation.
+// #define LOCKSTAT
+
+#ifdef LOCKSTAT
+void lockstat_lock_acquire(lock_t *lock, const char *name, const char *file,
+                           u32 line);
+void lockstat_lock_release(lock_t *lock);
+u64 lockstat_lock_acquire_irqsave(lock_t *lock, const char *name,
+                                  const char *file, u32 line);
+void lockstat_lock_release_irqrestore(lock_t *lock, u64 flags);
+void lockstat_mcs_lock_acquire(struct mcs_lock *lock, struct mcs_node *node,
+                               const char *name, const char *file, u32 line);
+void lockstat_mcs_lock_release(struct mcs_lock *lock, struct mcs_node *node);
+u64 lockstat_mcs_lock_acquire_irqsave(struct mcs_lock *lock,
+                                      struct mcs_node *node, const char *name,
+                                      const char *file, u32 line);
+void lockstat_mcs_lock_release_irqrestore(struct mcs_lock *lock,
+                                          struct mcs_node *node, u64 flags);
+void lockstat_reset(void);
+void lockstat_dump(void);
+
+// The lock implementations themselves define LOCK_IMPLEMENTATION.
+#ifndef LOCK_IMPLEMENTATION
+#define lock_acquire(lock)                                                     \
+  lockstat_lock_acquire((lock), #lock, __FILE__, __LINE__)
+#define lock_release(lock) lockstat_lock_release(lock)
+#define lock_acquire_irqsave(lock)                                             \
+  lockstat_lock_acquire_irqsave((lock), #lock, __FILE__, __LINE__)
+#define lock_release_irqrestore(lock, flags)                                   \
+  lockstat_lock_release_irqrestore((lock), (flags))
+#define mcs_lock_acquire(lock, node)                                           \
+  lockstat_mcs_lock_acquire((lock), (node), #lock, __FILE__, __LINE__)
+#define mcs_lock_release(lock, node) lockstat_mcs_lock_release((lock), (node))
+#define mcs_lock_acquire_irqsave(lock, node)                                   \
+  lockstat_mcs_lock_acquire_irqsave((lock), (node), #lock, __FILE__, __LINE__)
+#define mcs_lock_release_irqrestore(lock, node, flags)                         \
+  lockstat_mcs_lock_release_irqrestore((lock), (node), (flags))
+#endif // LOCK_IMPLEMENTATION
+#endif // LOCKSTAT
+#endif // LOCK_H
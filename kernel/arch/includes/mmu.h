@@ -2,6 +2,37 @@
 #define MMU_H
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <typedefs.h>
+
+#define PAGE_SIZE 0x1000
+
+#define PAGE_FLAG_PRESENT (1 << 0)
+#define PAGE_FLAG_WRITABLE (1 << 1)
+#define PAGE_FLAG_ACCESSED (1 << 5)
+#define PAGE_FLAG_DIRTY (1 << 6)
+// Ignored by the CPU, set on pages that are mapped read only but
+// should get a private copy once written to.
+#define PAGE_FLAG_COW (1 << 9)
+
+// Ignored by the CPU on non present pages. Set when the contents of the
+// page have been moved out of memory, the address bits then hold the
+// handle to get them back.
+#define PAGE_FLAG_SWAPPED (1 << 10)
+// Set together with PAGE_FLAG_SWAPPED when the page is in the swap area
+// on disk instead of zram, the handle is then the swap slot.
+#define PAGE_FLAG_ON_DISK (1 << 11)
+
+#define PAGE_FAULT_PRESENT (1 << 0)
+#define PAGE_FAULT_WRITE (1 << 1)
+
+// The part of the address space that every task has its own copy of.
+// These are 48 bit linear addresses. PML4 entry 0 is the identity map
+// while bootstrapping, 510 is the stack(which can't be write protected
+// or swapped out since the page fault handler needs it) and 511 is the
+// shared kernel.
+#define MMU_TASK_REGION_START ((uintptr_t)1 << 39)
+#define MMU_TASK_REGION_END ((uintptr_t)510 << 39)
 
 struct PML4T;
 struct mmu_directory {
@@ -9,6 +40,8 @@ struct mmu_directory {
   void *physical;
 };
 
+void *get_frame(bool allocate, u64 count);
+void *try_get_frame(void);
 void *ksbrk(size_t length);
 void *ksbrk_physical(size_t length, void **physical);
 int mmu_init(void *multiboot_header);
@@ -20,6 +53,17 @@ struct mmu_directory *mmu_clone_directory(struct mmu_directory *directory);
 struct mmu_directory *mmu_get_active_directory(void);
 void mmu_set_directory(struct mmu_directory *directory);
 void mmu_unmap_frames(void *src, size_t length);
+void mmu_map_pages(void *address, size_t length);
+void mmu_unmap_pages(void *address, size_t length);
+void mmu_map_physical(void *address, void *physical, size_t length);
+void mmu_move_pages(void *src, void *dst, size_t length);
 void mmu_remove_identity(void);
 void mmu_init_for_new_core(void (*main)(void));
+void copy_frame(void *physical_dst, void *physical_src);
+void mmu_frame_share(void *physical);
+void mmu_frame_release(void *physical);
+u16 mmu_frame_references(void *physical);
+uintptr_t *mmu_next_present_page(struct mmu_directory *directory,
+                                 uintptr_t *cursor, uintptr_t end);
+bool mmu_handle_page_fault(void *address, u64 error_code);
 #endif // MMU_H
@@ -0,0 +1,38 @@
+#include <completion.h>
+
+// Marks `done` as staying set for every waiter to come.
+#define COMPLETION_ALL 0xFFFFFFFF
+
+void completion_init(struct completion *completion) {
+  completion->done = 0;
+  completion->wait = (struct wait_queue){0};
+}
+
+// Lets one waiter through. May be called from interrupt handlers.
+void complete(struct completion *completion) {
+  u64 flags = lock_acquire_irqsave(&completion->wait.lock);
+  if (COMPLETION_ALL != completion->done) {
+    completion->done++;
+  }
+  wait_queue_wake_one_locked(&completion->wait);
+  lock_release_irqrestore(&completion->wait.lock, flags);
+}
+
+// Lets every current and future waiter through.
+void complete_all(struct completion *completion) {
+  u64 flags = lock_acquire_irqsave(&completion->wait.lock);
+  completion->done = COMPLETION_ALL;
+  wait_queue_wake_all_locked(&completion->wait);
+  lock_release_irqrestore(&completion->wait.lock, flags);
+}
+
+void wait_for_completion(struct completion *completion) {
+  u64 flags = lock_acquire_irqsave(&completion->wait.lock);
+  for (; 0 == completion->done;) {
+    wait_queue_sleep(&completion->wait, &flags);
+  }
+  if (COMPLETION_ALL != completion->done) {
+    completion->done--;
+  }
+  lock_release_irqrestore(&completion->wait.lock, flags);
+}
@@ -0,0 +1,17 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+#include <typedefs.h>
+#include <wait_queue.h>
+
+// For waiting until another task, core or interrupt handler is done
+// with something. A zeroed completion is not done.
+struct completion {
+  u32 done;
+  struct wait_queue wait;
+};
+
+void completion_init(struct completion *completion);
+void complete(struct completion *completion);
+void complete_all(struct completion *completion);
+void wait_for_completion(struct completion *completion);
+#endif // COMPLETION_H
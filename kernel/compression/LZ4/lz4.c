@@ -0,0 +1,176 @@
+#include <compression/LZ4/lz4.h>
+#include <string.h>
+
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+// The last match has to start at least this far from the end.
+#define MF_LIMIT 12
+
+static inline u32 read32(const u8 *p) {
+  return *(const u32 *)p;
+}
+
+static inline u32 hash(u32 v) {
+  return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static u8 *write_length(u8 *op, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *op++ = 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+// Emits one sequence. A `match_length` of 0 means that it is the final
+// sequence which only holds literals.
+static u8 *emit_sequence(u8 *op, u8 *oend, const u8 *literals,
+                         size_t literal_length, size_t offset,
+                         size_t match_length) {
+  size_t worst_case = 1 + literal_length + literal_length / 255 + 1 + 2 +
+                      match_length / 255 + 1;
+  if (worst_case > (size_t)(oend - op)) {
+    return NULL;
+  }
+
+  u8 *token = op++;
+  *token = (literal_length >= 15 ? 15 : literal_length) << 4;
+  if (literal_length >= 15) {
+    op = write_length(op, literal_length - 15);
+  }
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+
+  if (0 == match_length) {
+    return op;
+  }
+
+  *op++ = offset & 0xFF;
+  *op++ = (offset >> 8) & 0xFF;
+  match_length -= MIN_MATCH;
+  *token |= (match_length >= 15 ? 15 : match_length);
+  if (match_length >= 15) {
+    op = write_length(op, match_length - 15);
+  }
+  return op;
+}
+
+size_t lz4_compress(const u8 *src, size_t src_length, u8 *dst,
+                    size_t dst_capacity, u16 *table) {
+  const u8 *ip = src;
+  const u8 *anchor = src;
+  const u8 *iend = src + src_length;
+  u8 *op = dst;
+  u8 *oend = dst + dst_capacity;
+
+  if (src_length > MF_LIMIT) {
+    const u8 *mflimit = iend - MF_LIMIT;
+    const u8 *matchlimit = iend - LAST_LITERALS;
+    memset(table, 0, LZ4_HASH_SIZE * sizeof(u16));
+
+    // Position 0 is what the table is cleared to, every match is
+    // verified anyway.
+    ip++;
+    for (; ip < mflimit;) {
+      u32 h = hash(read32(ip));
+      const u8 *match = src + table[h];
+      table[h] = ip - src;
+      if (read32(match) != read32(ip)) {
+        ip++;
+        continue;
+      }
+      size_t offset = ip - match;
+
+      for (; ip > anchor && match > src && ip[-1] == match[-1];) {
+        ip--;
+        match--;
+      }
+      const u8 *match_start = ip;
+      ip += MIN_MATCH;
+      match += MIN_MATCH;
+      for (; ip < matchlimit && *ip == *match;) {
+        ip++;
+        match++;
+      }
+
+      op = emit_sequence(op, oend, anchor, match_start - anchor, offset,
+                         ip - match_start);
+      if (!op) {
+        return 0;
+      }
+      anchor = ip;
+    }
+  }
+
+  op = emit_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (!op) {
+    return 0;
+  }
+  return op - dst;
+}
+
+static bool read_length(const u8 **ip, const u8 *iend, size_t *length) {
+  u8 b;
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    b = *(*ip)++;
+    *length += b;
+  } while (255 == b);
+  return true;
+}
+
+bool lz4_decompress(const u8 *src, size_t src_length, u8 *dst,
+                    size_t dst_length) {
+  const u8 *ip = src;
+  const u8 *iend = src + src_length;
+  u8 *op = dst;
+  u8 *oend = dst + dst_length;
+
+  for (;;) {
+    if (ip >= iend) {
+      return false;
+    }
+    u8 token = *ip++;
+
+    size_t length = token >> 4;
+    if (15 == length && !read_length(&ip, iend, &length)) {
+      return false;
+    }
+    if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, length);
+    op += length;
+    ip += length;
+
+    if (ip == iend) {
+      return (op == oend);
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (0 == offset || offset > (size_t)(op - dst)) {
+      return false;
+    }
+
+    length = token & 0xF;
+    if (15 == length && !read_length(&ip, iend, &length)) {
+      return false;
+    }
+    length += MIN_MATCH;
+    if (length > (size_t)(oend - op)) {
+      return false;
+    }
+    // The match may overlap with what is being written.
+    const u8 *match = op - offset;
+    for (; length > 0; length--) {
+      *op++ = *match++;
+    }
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef LZ4_H
+#define LZ4_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <typedefs.h>
+
+#define LZ4_HASH_LOG 12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_LOG)
+
+// Compresses `src` into the LZ4 block format. `table` is scratch space
+// of LZ4_HASH_SIZE entries. Inputs have to be smaller than 64 KiB.
+// Returns the compressed size or 0 if it did not fit in `dst`.
+size_t lz4_compress(const u8 *src, size_t src_length, u8 *dst,
+                    size_t dst_capacity, u16 *table);
+// Returns false if `src` is malformed or does not decompress to exactly
+// `dst_length` bytes.
+bool lz4_decompress(const u8 *src, size_t src_length, u8 *dst,
+                    size_t dst_length);
+#endif // LZ4_H
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <mmu.h>
 #include <string.h>
+#include <task.h>
 
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08
@@ -337,26 +338,23 @@ u8 get_free_command_slot(volatile struct HBA_PORT *port, u8 *err) {
   return 0;
 }
 
-// is_write: Determins whether a read or write command will be used.
-u8 ahci_perform_command(volatile struct HBA_PORT *port, u32 startl, u32 starth,
-                        u32 count, u16 *buffer, u8 is_write) {
-  // TODO: The number of PRDT tables are hardcoded at a seemingly
-  // very low number. It can be up to 65,535. Should it maybe be
-  // changed?
-  assert(count <= num_prdt);
+// Gets a free command slot and clears its command table for `prdtl`
+// PRDT entries.
+static struct HBA_CMD_TBL *ahci_prepare_command(volatile struct HBA_PORT *port,
+                                                u16 prdtl, u8 is_write,
+                                                u32 *command_slot) {
   port->is = -1; // Clear pending interrupts
   u8 err;
-  u32 command_slot;
   do {
-    command_slot = get_free_command_slot(port, &err);
+    *command_slot = get_free_command_slot(port, &err);
   } while (err);
   struct HBA_CMD_HEADER *cmdheader =
       (struct HBA_CMD_HEADER *)physical_to_virtual((void *)port->clb);
   assert(0x20 == sizeof(struct HBA_CMD_HEADER));
-  cmdheader += command_slot;
+  cmdheader += *command_slot;
   cmdheader->w = is_write;
   cmdheader->cfl = sizeof(struct FIS_REG_H2D) / sizeof(u32);
-  cmdheader->prdtl = (u16)((count - 1) / 16 + 1); // Number of PRDT
+  cmdheader->prdtl = prdtl; // Number of PRDT
 
   // Write to the prdtl
   struct HBA_CMD_TBL *cmdtbl =
@@ -365,24 +363,14 @@ u8 ahci_perform_command(volatile struct HBA_PORT *port, u32 startl, u32 starth,
   memset((void *)cmdtbl, 0,
          sizeof(struct HBA_CMD_TBL) +
              (cmdheader->prdtl - 1) * sizeof(struct HBA_PRDT_ENTRY));
+  return cmdtbl;
+}
 
-  // 8K bytes (16 sectors) per PRDT
-  u16 i = 0;
-  for (; i < cmdheader->prdtl - 1; i++) {
-    cmdtbl->prdt_entry[i].dba = (u32)mmu_virtual_to_physical(buffer, NULL);
-    cmdtbl->prdt_entry[i].dbc =
-        8 * 1024 - 1; // 8K bytes (this value should always be set to 1 less
-                      // than the actual value)
-    cmdtbl->prdt_entry[i].i = 1;
-    buffer += 4 * 1024; // 4K words
-    count -= 16;        // 16 sectors
-  }
-  // FIXME: Edge case if the count does not fit. This should not be here it is
-  // ugly. Find a more general case.
-  cmdtbl->prdt_entry[i].dba = (u32)mmu_virtual_to_physical(buffer, NULL);
-  cmdtbl->prdt_entry[i].dbc = count * 512 - 1;
-  cmdtbl->prdt_entry[i].i = 1;
-
+// Sets up the FIS for a command whose PRDT has been filled in, issues it
+// and waits for it to complete.
+static u8 ahci_issue_command(volatile struct HBA_PORT *port, u32 command_slot,
+                             struct HBA_CMD_TBL *cmdtbl, u32 startl,
+                             u32 starth, u32 count, u8 is_write) {
   struct FIS_REG_H2D *cmdfis = (struct FIS_REG_H2D *)(&cmdtbl->cfis);
 
   cmdfis->fis_type = FIS_TYPE_REG_H2D;
@@ -425,6 +413,10 @@ u8 ahci_perform_command(volatile struct HBA_PORT *port, u32 startl, u32 starth,
       klog(LOG_ERROR, "AHCI command failed");
       return 0;
     }
+    // Let other tasks run while the disk is busy. Where that is not
+    // allowed, with a spinlock held or interrupts disabled, this returns
+    // at once and the loop keeps polling.
+    task_schedule();
   }
 
   // Check again
@@ -436,6 +428,74 @@ u8 ahci_perform_command(volatile struct HBA_PORT *port, u32 startl, u32 starth,
   return 1;
 }
 
+// is_write: Determins whether a read or write command will be used.
+u8 ahci_perform_command(volatile struct HBA_PORT *port, u32 startl, u32 starth,
+                        u32 count, u16 *buffer, u8 is_write) {
+  // TODO: The number of PRDT tables are hardcoded at a seemingly
+  // very low number. It can be up to 65,535. Should it maybe be
+  // changed?
+  assert(count <= num_prdt);
+  u32 command_slot;
+  u16 prdtl = (u16)((count - 1) / 16 + 1);
+  struct HBA_CMD_TBL *cmdtbl =
+      ahci_prepare_command(port, prdtl, is_write, &command_slot);
+
+  // 8K bytes (16 sectors) per PRDT
+  u16 i = 0;
+  for (; i < prdtl - 1; i++) {
+    cmdtbl->prdt_entry[i].dba = (u32)mmu_virtual_to_physical(buffer, NULL);
+    cmdtbl->prdt_entry[i].dbc =
+        8 * 1024 - 1; // 8K bytes (this value should always be set to 1 less
+                      // than the actual value)
+    cmdtbl->prdt_entry[i].i = 1;
+    buffer += 4 * 1024; // 4K words
+    count -= 16;        // 16 sectors
+  }
+  // FIXME: Edge case if the count does not fit. This should not be here it is
+  // ugly. Find a more general case.
+  cmdtbl->prdt_entry[i].dba = (u32)mmu_virtual_to_physical(buffer, NULL);
+  cmdtbl->prdt_entry[i].dbc = count * 512 - 1;
+  cmdtbl->prdt_entry[i].i = 1;
+
+  return ahci_issue_command(port, command_slot, cmdtbl, startl, starth, count,
+                            is_write);
+}
+
+// Transfers `count` whole frames, which do not have to be contiguous,
+// to or from consecutive sectors starting at `lba`. Every frame gets
+// its own PRDT entry.
+static bool ahci_perform_frame_command(u8 port_number, u64 lba, void **frames,
+                                       u32 count, u8 is_write) {
+  if (!hba || count > num_prdt || 0 == count) {
+    return false;
+  }
+  volatile struct HBA_PORT *port = &hba->ports[port_number];
+  u32 command_slot;
+  struct HBA_CMD_TBL *cmdtbl =
+      ahci_prepare_command(port, count, is_write, &command_slot);
+  for (u32 i = 0; i < count; i++) {
+    cmdtbl->prdt_entry[i].dba = (u32)(uintptr_t)frames[i];
+    cmdtbl->prdt_entry[i].dbau = (u32)((uintptr_t)frames[i] >> 32);
+    cmdtbl->prdt_entry[i].dbc = 0x1000 - 1;
+    cmdtbl->prdt_entry[i].i = 1;
+  }
+  u32 sectors = count * (0x1000 / 512);
+  return ahci_issue_command(port, command_slot, cmdtbl, (u32)lba,
+                            (u32)(lba >> 32), sectors, is_write);
+}
+
+u32 ahci_max_frames_per_command(void) {
+  return num_prdt;
+}
+
+bool ahci_write_frames(u8 port, u64 lba, void **frames, u32 count) {
+  return ahci_perform_frame_command(port, lba, frames, count, 1);
+}
+
+bool ahci_read_frames(u8 port, u64 lba, void **frames, u32 count) {
+  return ahci_perform_frame_command(port, lba, frames, count, 0);
+}
+
 u8 ahci_raw_write(volatile struct HBA_PORT *port, u32 startl, u32 starth,
                   u32 count, u16 *inbuffer) {
   return ahci_perform_command(port, startl, starth, count, inbuffer, 1);
@@ -1,3 +1,7 @@
 #include <stdbool.h>
+#include <typedefs.h>
 
 bool ahci_init(void);
+u32 ahci_max_frames_per_command(void);
+bool ahci_write_frames(u8 port, u64 lba, void **frames, u32 count);
+bool ahci_read_frames(u8 port, u64 lba, void **frames, u32 count);
@@ -1,4 +1,5 @@
 #include <arch/amd64/idt.h>
+#include <arch/amd64/preempt.h>
 #include <drivers/pit.h>
 #include <io.h>
 #include <kmalloc.h>
@@ -46,7 +47,16 @@ void pit_set_count(u16 _hertz) {
 void int_clock(struct cpu_status *r) {
   (void)r;
   eoi(0x20);
+  // Not while a lock is held or when the tick interrupted another
+  // handler.
+  if (preempt_count() > 0 || irq_depth() > 1) {
+    return;
+  }
+  // Tasks that have not run yet do not return through here, so the
+  // handler is left before switching.
+  irq_exit();
   task_legacy_switch();
+  irq_enter();
 }
 
 void pit_install(void) {
@@ -0,0 +1,281 @@
+#include <arch/amd64/idt.h>
+#include <arch/amd64/preempt.h>
+#include <arch/amd64/smp.h>
+#include <atomic.h>
+#include <ebr.h>
+#include <kmalloc.h>
+#include <stddef.h>
+
+// A core in a read section announces the global epoch it saw when it
+// entered. The epoch only moves on once every core in a read section
+// has seen the current one, so readers are at most one epoch behind.
+// An object freed in epoch `n` can only have been reached by readers
+// of epoch `n` or `n - 1`, and all of those are gone once the epoch is
+// `n + 2`.
+//
+// Freed objects are collected per core in batches that remember the
+// newest epoch of their objects. Objects of a batch that is old enough
+// are still checked against the hazard pointers, the protected ones
+// are kept and the batch is queued again.
+//
+// The epoch is only advanced by cores that have something to free, at
+// their next ebr_free() or ebr_collect().
+
+#define EBR_BATCH_SIZE 60
+#define EBR_HAZARD_POINTERS 64
+// Set in the epoch of a core while it is in a read section.
+#define EBR_ACTIVE (1ULL << 63)
+
+struct ebr_batch {
+  struct ebr_batch *next;
+  u64 epoch;
+  u32 count;
+  void *objects[EBR_BATCH_SIZE];
+};
+
+// Only used by its core, with interrupts disabled.
+struct ebr_cpu {
+  // Read by the other cores.
+  u64 epoch;
+  u32 nesting;
+  // Being filled.
+  struct ebr_batch *current;
+  // Full batches, oldest epoch first.
+  struct ebr_batch *head;
+  struct ebr_batch *tail;
+  // So that a busy core does not allocate a batch for every
+  // EBR_BATCH_SIZE frees.
+  struct ebr_batch *spare;
+} CACHE_LINE_ALIGNED;
+
+u64 ebr_epoch = 0;
+// cpu_count entries.
+struct ebr_cpu *ebr_cpus = NULL;
+struct hazard_pointer ebr_hazard_pointers[EBR_HAZARD_POINTERS];
+// Objects that could not be queued for lack of memory, they are never
+// freed.
+u64 ebr_leaked = 0;
+
+bool ebr_init(void) {
+  ebr_cpus = kcalloc(cpu_count, sizeof(struct ebr_cpu));
+  return (NULL != ebr_cpus);
+}
+
+// Read sections nest, also with those of interrupt handlers.
+void ebr_read_lock(void) {
+  preempt_disable();
+  u64 flags = interrupts_save_disable();
+  struct ebr_cpu *cpu = &ebr_cpus[core_id_get()];
+  if (0 == cpu->nesting++) {
+    // Has to be visible to the other cores before anything is read.
+    atomic_store_seq_cst(&cpu->epoch,
+                         atomic_load_relaxed(&ebr_epoch) | EBR_ACTIVE);
+  }
+  interrupts_restore(flags);
+}
+
+void ebr_read_unlock(void) {
+  u64 flags = interrupts_save_disable();
+  struct ebr_cpu *cpu = &ebr_cpus[core_id_get()];
+  if (0 == --cpu->nesting) {
+    atomic_store_release(&cpu->epoch, 0);
+  }
+  interrupts_restore(flags);
+  preempt_enable();
+}
+
+// Returns the epoch, advanced if every reader has seen it.
+static u64 ebr_try_advance(void) {
+  u64 epoch = atomic_load_seq_cst(&ebr_epoch);
+  for (u32 i = 0; i < cpu_count; i++) {
+    u64 cpu_epoch = atomic_load_seq_cst(&ebr_cpus[i].epoch);
+    if ((cpu_epoch & EBR_ACTIVE) && (cpu_epoch & ~EBR_ACTIVE) != epoch) {
+      return epoch;
+    }
+  }
+  // On failure another core has advanced it.
+  if (atomic_cmpxchg_seq_cst(&ebr_epoch, &epoch, epoch + 1)) {
+    return epoch + 1;
+  }
+  return epoch;
+}
+
+static void ebr_queue(struct ebr_cpu *cpu, struct ebr_batch *batch) {
+  batch->next = NULL;
+  if (cpu->tail) {
+    cpu->tail->next = batch;
+  } else {
+    cpu->head = batch;
+  }
+  cpu->tail = batch;
+}
+
+// Takes the batches no reader can see anymore off the queue.
+static struct ebr_batch *ebr_take_ready(struct ebr_cpu *cpu) {
+  if (!cpu->head) {
+    return NULL;
+  }
+  u64 epoch = ebr_try_advance();
+  struct ebr_batch *ready = NULL;
+  struct ebr_batch **ready_tail = &ready;
+  for (; cpu->head && cpu->head->epoch + 2 <= epoch;) {
+    *ready_tail = cpu->head;
+    ready_tail = &cpu->head->next;
+    cpu->head = cpu->head->next;
+  }
+  *ready_tail = NULL;
+  if (!cpu->head) {
+    cpu->tail = NULL;
+  }
+  return ready;
+}
+
+static bool ebr_protected(void **hazards, u32 count, void *p) {
+  for (u32 i = 0; i < count; i++) {
+    if (hazards[i] == p) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Frees the objects no hazard pointer points to. Returns false if some
+// had to be kept.
+static bool ebr_batch_free(struct ebr_batch *batch) {
+  void *hazards[EBR_HAZARD_POINTERS];
+  u32 hazard_count = 0;
+  for (u32 i = 0; i < EBR_HAZARD_POINTERS; i++) {
+    void *p = atomic_load_seq_cst(&ebr_hazard_pointers[i].pointer);
+    if (p) {
+      hazards[hazard_count++] = p;
+    }
+  }
+
+  u32 kept = 0;
+  for (u32 i = 0; i < batch->count; i++) {
+    void *p = batch->objects[i];
+    if (ebr_protected(hazards, hazard_count, p)) {
+      batch->objects[kept++] = p;
+      continue;
+    }
+    kfree(p);
+  }
+  batch->count = kept;
+  return (0 == kept);
+}
+
+// Queues the batch being filled and frees what no reader can see
+// anymore. Called from the idle loops, so that objects do not wait for
+// a batch to fill up.
+void ebr_collect(void) {
+  u64 flags = interrupts_save_disable();
+  struct ebr_cpu *cpu = &ebr_cpus[core_id_get()];
+  if (cpu->current && cpu->current->count > 0) {
+    ebr_queue(cpu, cpu->current);
+    cpu->current = NULL;
+  }
+  struct ebr_batch *ready = ebr_take_ready(cpu);
+  interrupts_restore(flags);
+
+  // The frees are done with interrupts enabled again.
+  for (; ready;) {
+    struct ebr_batch *next = ready->next;
+    bool empty = ebr_batch_free(ready);
+    flags = interrupts_save_disable();
+    cpu = &ebr_cpus[core_id_get()];
+    if (!empty) {
+      ready->epoch = atomic_load_seq_cst(&ebr_epoch);
+      ebr_queue(cpu, ready);
+    } else if (!cpu->spare) {
+      cpu->spare = ready;
+    } else {
+      kfree(ready);
+    }
+    interrupts_restore(flags);
+    ready = next;
+  }
+}
+
+// Frees `p` once no reader can see it anymore, it has to be unlinked
+// already. May be called from within a read section and from interrupt
+// handlers.
+void ebr_free(void *p) {
+  if (!p) {
+    return;
+  }
+  // Orders the unlinking of `p` before the epoch is read.
+  atomic_fence_seq_cst();
+  u64 flags = interrupts_save_disable();
+  struct ebr_cpu *cpu = &ebr_cpus[core_id_get()];
+  if (!cpu->current) {
+    struct ebr_batch *batch = cpu->spare;
+    cpu->spare = NULL;
+    if (!batch) {
+      batch = kmalloc_flags(sizeof(struct ebr_batch), KMALLOC_ATOMIC);
+    }
+    if (!batch) {
+      interrupts_restore(flags);
+      atomic_fetch_add_relaxed(&ebr_leaked, 1);
+      return;
+    }
+    batch->count = 0;
+    cpu->current = batch;
+  }
+  struct ebr_batch *batch = cpu->current;
+  batch->objects[batch->count++] = p;
+  batch->epoch = atomic_load_seq_cst(&ebr_epoch);
+  bool full = (EBR_BATCH_SIZE == batch->count);
+  interrupts_restore(flags);
+  if (full) {
+    ebr_collect();
+  }
+}
+
+// Waits for every read section that was running when called. Must not
+// be called from within one.
+void ebr_synchronize(void) {
+  atomic_fence_seq_cst();
+  u64 epoch = atomic_load_seq_cst(&ebr_epoch) + 2;
+  for (; ebr_try_advance() < epoch;) {
+    cpu_relax();
+  }
+}
+
+// Returns NULL if all are taken.
+struct hazard_pointer *hazard_pointer_get(void) {
+  for (u32 i = 0; i < EBR_HAZARD_POINTERS; i++) {
+    struct hazard_pointer *hp = &ebr_hazard_pointers[i];
+    u32 expected = 0;
+    if (!atomic_load_relaxed(&hp->used) &&
+        atomic_cmpxchg_acquire(&hp->used, &expected, 1)) {
+      return hp;
+    }
+  }
+  return NULL;
+}
+
+void hazard_pointer_put(struct hazard_pointer *hp) {
+  hazard_pointer_clear(hp);
+  atomic_store_release(&hp->used, 0);
+}
+
+// Loads the pointer from `source` and protects it from being freed by
+// ebr_free() until the hazard pointer is cleared or set again. The
+// pointer is published before `source` is read again, if it still
+// holds it the object has not been unlinked before the free could see
+// the hazard pointer.
+void *hazard_pointer_protect(struct hazard_pointer *hp, void **source) {
+  void *p = atomic_load_relaxed(source);
+  for (;;) {
+    atomic_store_seq_cst(&hp->pointer, p);
+    void *again = atomic_load_acquire(source);
+    if (again == p) {
+      return p;
+    }
+    p = again;
+  }
+}
+
+void hazard_pointer_clear(struct hazard_pointer *hp) {
+  atomic_store_release(&hp->pointer, NULL);
+}
@@ -0,0 +1,47 @@
+#ifndef EBR_H
+#define EBR_H
+#include <atomic.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+// Deferred freeing for lock-free data structures. A writer unlinks an
+// object and hands it to ebr_free() instead of kfree(), it is freed
+// once no reader can still hold a reference to it:
+//
+//   ebr_read_lock();
+//   for (p = atomic_load_acquire(&head); p;
+//        p = atomic_load_acquire(&p->next)) {
+//     ...
+//   }
+//   ebr_read_unlock();
+//
+// Unlike rcu_head there is nothing to embed in the object, and the
+// frees are done in batches.
+//
+// A reader may not sleep inside a read section, as it holds up every
+// free in the system until it leaves. A reference that has to be kept
+// longer is protected with a hazard pointer instead, which only holds
+// up the object it points to:
+//
+//   struct hazard_pointer *hp = hazard_pointer_get();
+//   struct object *p = hazard_pointer_protect(hp, (void **)&head);
+//   ...
+//   hazard_pointer_put(hp);
+
+struct hazard_pointer {
+  void *pointer;
+  u32 used;
+} CACHE_LINE_ALIGNED;
+
+bool ebr_init(void);
+void ebr_read_lock(void);
+void ebr_read_unlock(void);
+void ebr_free(void *p);
+void ebr_collect(void);
+void ebr_synchronize(void);
+
+struct hazard_pointer *hazard_pointer_get(void);
+void hazard_pointer_put(struct hazard_pointer *hp);
+void *hazard_pointer_protect(struct hazard_pointer *hp, void **source);
+void hazard_pointer_clear(struct hazard_pointer *hp);
+#endif // EBR_H
@@ -9,7 +9,7 @@ struct vfs_fd *ramfs_open(struct vfs_mount *mount, struct sv file, int flags,
   (void)flags;
   (void)err;
   kprintf("open: " SV_FMT "\n", SV_FMT_ARG(file));
-  struct vfs_fd *fd = kmalloc(sizeof(struct vfs_fd));
+  struct vfs_fd *fd = vfs_fd_alloc();
   //  fd->open = NULL;
   return fd;
 }
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <fs/vfs.h>
-#include <kmalloc.h>
+#include <lock.h>
+#include <mm/slab.h>
+#include <rcu.h>
 #include <stdbool.h>
 
 struct mount_list {
@@ -8,11 +10,33 @@ struct mount_list {
   struct mount_list *next;
 };
 
+// Looked up on every open but only changed when mounting, readers walk
+// the list under RCU. Only serialises adding mounts.
+lock_t mount_lock;
 struct mount_list *mount_head = NULL;
 
-struct vfs_mount *vfs_find_mount(struct sv path) {
-  struct mount_list *p = mount_head;
-  for (; p; p = p->next) {
+struct kmem_cache *mount_list_cache = NULL;
+struct kmem_cache *vfs_fd_cache = NULL;
+
+bool vfs_init(void) {
+  mount_list_cache = kmem_cache_create(
+      "mount_list", sizeof(struct mount_list), CACHE_LINE_SIZE, NULL);
+  vfs_fd_cache = kmem_cache_create("vfs_fd", sizeof(struct vfs_fd),
+                                   CACHE_LINE_SIZE, NULL);
+  return (mount_list_cache && vfs_fd_cache);
+}
+
+struct vfs_fd *vfs_fd_alloc(void) {
+  return kmem_cache_alloc(vfs_fd_cache);
+}
+
+void vfs_fd_free(struct vfs_fd *fd) {
+  kmem_cache_free(vfs_fd_cache, fd);
+}
+
+static struct vfs_mount *find_mount(struct sv path) {
+  struct mount_list *p = rcu_dereference(mount_head);
+  for (; p; p = rcu_dereference(p->next)) {
     if (sv_partial_eq(path, p->mount->path)) {
       return p->mount;
     }
@@ -20,10 +44,15 @@ struct vfs_mount *vfs_find_mount(struct sv path) {
   return NULL;
 }
 
-bool vfs_add_mount(struct sv path, struct vfs_mount *root) {
-  assert(!vfs_find_mount(path));
+struct vfs_mount *vfs_find_mount(struct sv path) {
+  rcu_read_lock();
+  struct vfs_mount *mount = find_mount(path);
+  rcu_read_unlock();
+  return mount;
+}
 
-  struct mount_list *mount = kmalloc(sizeof(struct mount_list));
+bool vfs_add_mount(struct sv path, struct vfs_mount *root) {
+  struct mount_list *mount = kmem_cache_alloc(mount_list_cache);
   if (!mount) {
     return false;
   }
@@ -31,8 +60,11 @@ bool vfs_add_mount(struct sv path, struct vfs_mount *root) {
   mount->mount = root;
   root->path = sv_clone(path);
 
+  lock_acquire(&mount_lock);
+  assert(!find_mount(path));
   mount->next = mount_head;
-  mount_head = mount;
+  rcu_assign_pointer(mount_head, mount);
+  lock_release(&mount_lock);
 
   return true;
 }
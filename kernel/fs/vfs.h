@@ -14,6 +14,8 @@ struct vfs_mount {
 struct vfs_fd {};
 
 bool vfs_init(void);
+struct vfs_fd *vfs_fd_alloc(void);
+void vfs_fd_free(struct vfs_fd *fd);
 struct vfs_fd *vfs_open(struct sv file, int flags, int *err);
 bool vfs_add_mount(struct sv path, struct vfs_mount *root);
 
@@ -1,15 +1,21 @@
 #include <assert.h>
+#include <atomic.h>
 #include <csprng.h>
 #include <drivers/ahci.h>
 #include <drivers/pit.h>
 #include <drivers/ps2_keyboard.h>
 #include <drivers/serial.h>
+#include <ebr.h>
 #include <fs/ramfs.h>
 #include <fs/vfs.h>
 #include <kmalloc.h>
 #include <kprintf.h>
+#include <mm/ksm.h>
+#include <mm/slab.h>
+#include <mm/zram.h>
 #include <mmu.h>
 #include <prng.h>
+#include <rcu.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -20,17 +26,37 @@
 #include <arch/amd64/idt.h>
 #include <arch/amd64/msr.h>
 #include <arch/amd64/smp.h>
+#include <arch/amd64/tlb.h>
 
 #include "multiboot2.h"
 
 struct multiboot_tag *tags;
 
+// The BSP is online for RCU from early on, so it has to keep reporting
+// quiescent states once there is nothing left to do.
+static void idle_loop(void) {
+  for (;;) {
+    rcu_quiescent_state();
+    ebr_collect();
+    ksm_scan_periodic();
+    cpu_relax();
+  }
+}
+
 void kmain2(void) {
+  assert(smp_enumerate(tags));
+  assert(slab_cpus_init());
   assert(kmalloc_init());
+  assert(zram_init());
+  assert(rcu_init());
+  rcu_cpu_online();
+  assert(ebr_init());
 
   // assert(ps2_keyboard_init());
 
   // ahci_init();
+  // Swap stays off on purpose while the disk is not set up, once it is
+  // an area of it has to be set aside with swap_init().
 
   //  assert(task_init());
 
@@ -48,13 +74,15 @@ void kmain2(void) {
 
   idt_init();
   assert(apic_enable());
+  assert(tlb_init());
+  tlb_cpu_online();
 
-  smp_init(tags);
+  smp_init();
   mmu_remove_identity();
 
-  for (;;)
-    ;
+  idle_loop();
 
+  assert(vfs_init());
   vfs_add_mount(C_TO_SV("/"), ramfs_init());
   vfs_open(C_TO_SV("/test.txt"), 0, NULL);
 
@@ -69,11 +97,11 @@ void kmain2(void) {
     kprintf("parent\n");
   }
   */
-  for (;;)
-    ;
+  idle_loop();
 }
 
 void kmain(u32 magic, void *arg) {
+  percpu_init(&percpu_boot, 0);
   if (MULTIBOOT2_BOOTLOADER_MAGIC != magic) {
     kprintf("Invalid magic: %x\n", magic);
     return;
@@ -1,98 +1,126 @@
+#include <arch/amd64/idt.h>
 #include <assert.h>
+#include <atomic.h>
 #include <kmalloc.h>
 #include <kprintf.h>
 #include <lock.h>
 #include <math.h>
+#include <mm/alloc_profile.h>
+#include <mm/guard.h>
+#include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <mmu.h>
 #include <prng.h>
 #include <stdint.h>
 #include <string.h>
 #define NEW_ALLOC_SIZE 0x8000
+// Default for kmalloc_set_heap_watermark().
+#define HEAP_DEFAULT_WATERMARK 0x40000
 
-lock_t heap_lock;
+// Every allocation above the slab sizes goes through it, so it is a
+// queued lock. Interrupts stay disabled while it is held, that way an
+// interrupt handler never waits for the code it interrupted and can use
+// the heap as well.
+struct mcs_lock heap_lock;
 
 // #define KMALLOC_DEBUG
 
+#ifdef KMALLOC_DEBUG
+// Every allocation that fits gets guard pages.
+#define KMALLOC_DEFAULT_SAMPLE_RATE 1
+#else
+#define KMALLOC_DEFAULT_SAMPLE_RATE 1000
+#endif // KMALLOC_DEBUG
+
+enum kmalloc_hardening kmalloc_hardening = KMALLOC_HARDENING_SAMPLED;
+u32 kmalloc_sample_rate = KMALLOC_DEFAULT_SAMPLE_RATE;
+// Allocations left until the next sampled one. Not atomic, a lost update
+// only moves the next sample.
+u32 kmalloc_sample_countdown = KMALLOC_DEFAULT_SAMPLE_RATE;
+
 #define IS_FREE (1 << 0)
 #define IS_FINAL (1 << 1)
+// Not part of the heap, the allocation has its own pages.
+#define IS_LARGE (1 << 2)
+
+#define MALLOC_MAGIC 0xdde51ab9410268b1
+
+// The heap is a two level segregated fit (TLSF) allocator. Free blocks
+// are kept in lists by size, the first level splits sizes by powers of
+// two and the second level splits each of those in HEAP_SL_COUNT
+// ranges. Bitmaps of the non empty lists let a fitting block be found
+// without walking anything. Every block knows its physical neighbours
+// so it is merged with them as soon as it is freed.
+
+#define HEAP_SL_LOG2 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_LOG2)
+#define HEAP_FL_COUNT 29
+// Room for the free list links.
+#define HEAP_MIN_BLOCK 16
+#define HEAP_MAX_ALLOCATION ((u32)1 << 31)
+// From this size on allocations get pages of their own, so they can be
+// grown by mapping more pages and moving the existing ones.
+#define KMALLOC_LARGE_SIZE 0x10000
 
 typedef struct MallocHeader {
   u64 magic;
   u32 size;
   u8 flags;
+  // The physically previous block, NULL for the first one in a region.
+  struct MallocHeader *prev;
+  // Also the physically next block unless IS_FINAL is set.
   struct MallocHeader *n;
 } MallocHeader;
 
+// Start of every region of heap memory. Regions get pages of their own
+// from vmalloc so they can be given back once nothing in them is used.
+struct heap_region {
+  struct heap_region *next;
+  struct heap_region *prev;
+  size_t length;
+};
+
+// Keeps the blocks 16 byte aligned.
+#define HEAP_REGION_HEADER ((sizeof(struct heap_region) + 15) & ~(size_t)15)
+
+// Kept in the data of free blocks.
+struct heap_free_links {
+  MallocHeader *next;
+  MallocHeader *prev;
+};
+
 u64 delta_page(u64 a) {
   return 0x1000 - (a % 0x1000);
 }
 
-MallocHeader *head = NULL;
-MallocHeader *final = NULL;
-u32 total_heap_size = 0;
+struct heap_region *heap_regions = NULL;
+u64 total_heap_size = 0;
+// Bytes in free blocks.
+u64 heap_free_size = 0;
+// Free memory above this is given back, see kmalloc_set_heap_watermark().
+u64 heap_watermark = HEAP_DEFAULT_WATERMARK;
 
-void *kmalloc_align(size_t s, void **physical) {
-  // TODO: It should reuse virtual regions so that it does not run out
-  // of address space.
-  void *rc;
-  if (!(rc = ksbrk_physical(s, physical))) {
-    return NULL;
-  }
-  return rc;
-}
+// Large allocations freed with interrupts disabled, linked through `n`.
+// Unmapping has to wait for a free with interrupts enabled.
+MallocHeader *large_deferred = NULL;
 
-void kmalloc_align_free(void *p, size_t s) {
-  // TODO
-  (void)p;
-  (void)s;
-}
+u32 heap_fl_bitmap = 0;
+u16 heap_sl_bitmap[HEAP_FL_COUNT];
+MallocHeader *heap_free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
 
-int kmalloc_init(void) {
-  head = (MallocHeader *)ksbrk(NEW_ALLOC_SIZE);
-  if (!head) {
-    return 0;
-  }
-  total_heap_size += NEW_ALLOC_SIZE - sizeof(MallocHeader);
-  head->magic = 0xdde51ab9410268b1;
-  head->size = NEW_ALLOC_SIZE - sizeof(MallocHeader);
-  head->flags = IS_FREE | IS_FINAL;
-  head->n = NULL;
-  final = head;
-  return 1;
+// Page aligned and physically contiguous, meant for DMA buffers.
+void *kmalloc_align(size_t s, void **physical) {
+  return vmalloc_contiguous(s, physical);
 }
 
-int add_heap_memory(size_t min_desired) {
-  min_desired += sizeof(MallocHeader);
-  size_t allocation_size = max(min_desired, NEW_ALLOC_SIZE);
-  allocation_size += delta_page(allocation_size);
-  allocation_size += NEW_ALLOC_SIZE;
-  void *p;
-  if (!(p = ksbrk(allocation_size))) {
-    return 0;
-  }
-  total_heap_size += allocation_size - sizeof(MallocHeader);
-  if (IS_FREE & final->flags) {
-    void *e = final;
-    e = (void *)((uintptr_t)e + sizeof(MallocHeader) + final->size);
-    if (p == e) {
-      final->size += allocation_size - sizeof(MallocHeader);
-      return 1;
-    }
-  }
-  MallocHeader *new_entry = p;
-  new_entry->size = allocation_size - sizeof(MallocHeader);
-  new_entry->flags = IS_FREE | IS_FINAL;
-  new_entry->n = NULL;
-  new_entry->magic = 0xdde51ab9410268b1;
-  final->n = new_entry;
-  final = new_entry;
-  return 1;
+void kmalloc_align_free(void *p, size_t s) {
+  vfree(p, s);
 }
 
 static MallocHeader *next_header(MallocHeader *a) {
-  assert(a->magic == 0xdde51ab9410268b1);
+  assert(a->magic == MALLOC_MAGIC);
   if (a->n) {
-    if (a->n->magic != 0xdde51ab9410268b1) {
+    if (a->n->magic != MALLOC_MAGIC) {
       kprintf("Real magic value is: %x\n", a->n->magic);
       kprintf("location: %x\n", &(a->n->magic));
       assert(0);
@@ -102,13 +130,20 @@ static MallocHeader *next_header(MallocHeader *a) {
   return NULL;
 }
 
+static MallocHeader *region_first_block(struct heap_region *region) {
+  return (MallocHeader *)((uintptr_t)region + HEAP_REGION_HEADER);
+}
+
 void kmalloc_scan(void) {
-  if (!head) {
-    return;
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  struct heap_region *region = heap_regions;
+  for (; region; region = region->next) {
+    MallocHeader *p = region_first_block(region);
+    for (; (p = next_header(p));)
+      ;
   }
-  MallocHeader *p = head;
-  for (; (p = next_header(p));)
-    ;
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
 }
 
 static MallocHeader *next_close_header(MallocHeader *a) {
@@ -119,111 +154,434 @@ static MallocHeader *next_close_header(MallocHeader *a) {
   return next_header(a);
 }
 
-int merge_headers(MallocHeader *b);
+static struct heap_free_links *free_links(MallocHeader *h) {
+  return (struct heap_free_links *)(h + 1);
+}
+
+static void heap_mapping(u32 size, u32 *fl, u32 *sl) {
+  if (size < HEAP_SL_COUNT) {
+    *fl = 0;
+    *sl = size;
+    return;
+  }
+  u32 f = 31 - __builtin_clz(size);
+  *fl = f - (HEAP_SL_LOG2 - 1);
+  *sl = (size >> (f - HEAP_SL_LOG2)) ^ HEAP_SL_COUNT;
+}
+
+static void heap_insert_free(MallocHeader *h) {
+  u32 fl, sl;
+  heap_mapping(h->size, &fl, &sl);
+  struct heap_free_links *links = free_links(h);
+  links->prev = NULL;
+  links->next = heap_free_lists[fl][sl];
+  if (links->next) {
+    free_links(links->next)->prev = h;
+  }
+  heap_free_lists[fl][sl] = h;
+  heap_free_size += h->size;
+  heap_fl_bitmap |= (u32)1 << fl;
+  heap_sl_bitmap[fl] |= (u16)1 << sl;
+}
+
+static void heap_remove_free(MallocHeader *h) {
+  u32 fl, sl;
+  heap_mapping(h->size, &fl, &sl);
+  struct heap_free_links *links = free_links(h);
+  if (links->prev) {
+    free_links(links->prev)->next = links->next;
+  } else {
+    heap_free_lists[fl][sl] = links->next;
+  }
+  if (links->next) {
+    free_links(links->next)->prev = links->prev;
+  }
+  heap_free_size -= h->size;
+  if (heap_free_lists[fl][sl]) {
+    return;
+  }
+  heap_sl_bitmap[fl] &= ~((u16)1 << sl);
+  if (!heap_sl_bitmap[fl]) {
+    heap_fl_bitmap &= ~((u32)1 << fl);
+  }
+}
 
-static MallocHeader *find_free_entry(u32 s) {
-  // A new header is required as well as the newly allocated chunk
-  s += sizeof(MallocHeader);
-  if (!head) {
-    if (!kmalloc_init()) {
+// Takes a free block of at least `size` bytes off its list. The size is
+// rounded up to the next list first so any block in the list fits.
+static MallocHeader *heap_find_free(u32 size) {
+  if (size >= HEAP_SL_COUNT) {
+    u32 f = 31 - __builtin_clz(size);
+    size += ((u32)1 << (f - HEAP_SL_LOG2)) - 1;
+  }
+  u32 fl, sl;
+  heap_mapping(size, &fl, &sl);
+  u32 sl_map = heap_sl_bitmap[fl] & (~(u32)0 << sl);
+  if (!sl_map) {
+    u32 fl_map = heap_fl_bitmap & (~(u32)0 << (fl + 1));
+    if (!fl_map) {
       return NULL;
     }
+    fl = __builtin_ctz(fl_map);
+    sl_map = heap_sl_bitmap[fl];
   }
-  MallocHeader *p = head;
-  for (; p; p = next_header(p)) {
-    assert(p->magic == 0xdde51ab9410268b1);
-    if (!(p->flags & IS_FREE)) {
-      continue;
-    }
-    u64 required_size = s;
-    if (p->size < required_size) {
-      for (; merge_headers(p);)
-        ;
-      if (p->size >= required_size) {
-        return p;
+  sl = __builtin_ctz(sl_map);
+  MallocHeader *h = heap_free_lists[fl][sl];
+  heap_remove_free(h);
+  return h;
+}
+
+// Merges `b` into `a`, which it has to physically follow.
+static void heap_absorb(MallocHeader *a, MallocHeader *b) {
+  MallocHeader *next = next_close_header(b);
+  a->size += sizeof(MallocHeader) + b->size;
+  a->flags |= b->flags & IS_FINAL;
+  a->n = b->n;
+  if (next) {
+    next->prev = a;
+  }
+  b->magic = 0;
+}
+
+// Marks the block as free and merges it with its free neighbours.
+// Returns the merged block.
+static MallocHeader *heap_release_block(MallocHeader *h) {
+  h->flags |= IS_FREE;
+  MallocHeader *next = next_close_header(h);
+  if (next && (next->flags & IS_FREE)) {
+    heap_remove_free(next);
+    heap_absorb(h, next);
+  }
+  MallocHeader *prev = h->prev;
+  if (prev && (prev->flags & IS_FREE)) {
+    heap_remove_free(prev);
+    heap_absorb(prev, h);
+    h = prev;
+  }
+  heap_insert_free(h);
+  return h;
+}
+
+// Cuts the block down to `size` bytes and frees the rest, if the rest
+// is large enough to be a block of its own.
+static void heap_split(MallocHeader *h, u32 size) {
+  if (h->size < size + sizeof(MallocHeader) + HEAP_MIN_BLOCK) {
+    return;
+  }
+  MallocHeader *rest = (MallocHeader *)((uintptr_t)(h + 1) + size);
+  MallocHeader *next = next_close_header(h);
+  rest->magic = MALLOC_MAGIC;
+  rest->size = h->size - size - sizeof(MallocHeader);
+  rest->flags = h->flags & IS_FINAL;
+  rest->prev = h;
+  rest->n = h->n;
+  if (next) {
+    next->prev = rest;
+  }
+  h->size = size;
+  h->flags &= ~IS_FINAL;
+  h->n = rest;
+  heap_release_block(rest);
+}
+
+static u32 heap_block_size(size_t s) {
+  return max((s + 7) & ~(size_t)7, HEAP_MIN_BLOCK);
+}
+
+// Walks every block of the heap, see kmalloc_scan(), and prints how the
+// used blocks are spread over the first level size classes and how
+// fragmented the free memory is.
+void kmalloc_dump_stats(void) {
+  u64 used_blocks[HEAP_FL_COUNT] = {0};
+  u64 regions = 0;
+  u64 used = 0;
+  u64 used_bytes = 0;
+  u64 free = 0;
+  u64 free_bytes = 0;
+  u64 largest_free = 0;
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  struct heap_region *region = heap_regions;
+  for (; region; region = region->next) {
+    regions++;
+    MallocHeader *p = region_first_block(region);
+    for (; p; p = next_header(p)) {
+      if (p->flags & IS_FREE) {
+        free++;
+        free_bytes += p->size;
+        largest_free = max(largest_free, p->size);
+        continue;
       }
-      continue;
+      u32 fl, sl;
+      heap_mapping(p->size, &fl, &sl);
+      used++;
+      used_bytes += p->size;
+      used_blocks[fl]++;
+    }
+  }
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+
+  kprintf("heap: %ld regions, %ld bytes\n", regions, total_heap_size);
+  kprintf("heap: used: %ld blocks, %ld bytes\n", used, used_bytes);
+  kprintf("heap: free: %ld blocks, %ld bytes, largest: %ld\n", free,
+          free_bytes, largest_free);
+  // The share of free memory that can't be used for one allocation.
+  u64 fragmentation = 0;
+  if (free_bytes > 0) {
+    fragmentation = 100 - (largest_free * 100) / free_bytes;
+  }
+  kprintf("heap: fragmentation: %ld%%\n", fragmentation);
+  for (u32 i = 0; i < HEAP_FL_COUNT; i++) {
+    if (used_blocks[i] > 0) {
+      u32 base = (i > 0) ? (u32)1 << (i + HEAP_SL_LOG2 - 1) : 0;
+      kprintf("heap: blocks from %d bytes: %ld\n", base, used_blocks[i]);
     }
-    return p;
   }
-  return NULL;
 }
 
-int merge_headers(MallocHeader *b) {
-  if (!(b->flags & IS_FREE)) {
-    return 0;
+// Called with heap_lock held.
+static void heap_add_region(struct heap_region *region, size_t length) {
+  region->length = length;
+  region->prev = NULL;
+  region->next = heap_regions;
+  if (heap_regions) {
+    heap_regions->prev = region;
   }
+  heap_regions = region;
+
+  MallocHeader *h = region_first_block(region);
+  h->magic = MALLOC_MAGIC;
+  h->size = length - HEAP_REGION_HEADER - sizeof(MallocHeader);
+  h->flags = IS_FINAL;
+  h->prev = NULL;
+  h->n = NULL;
+  total_heap_size += h->size;
+  heap_release_block(h);
+}
 
-  MallocHeader *n = next_close_header(b);
-  if (!n) {
-    return 0;
+// Called with heap_lock held. Takes the region of the free block `h` out
+// of the heap if it is the only block in it and enough memory would stay
+// free. Giving it back is up to the caller since unmapping must not
+// happen under heap_lock.
+//
+// Keeping at least half of the watermark free is the hysteresis, a heap
+// that just shrank can take a spike of that size without growing again.
+static struct heap_region *heap_take_region(MallocHeader *h) {
+  if (h->prev || !(h->flags & IS_FINAL)) {
+    return NULL;
   }
+  if (heap_free_size <= heap_watermark ||
+      heap_free_size - h->size < heap_watermark / 2) {
+    return NULL;
+  }
+  struct heap_region *region =
+      (struct heap_region *)((uintptr_t)h - HEAP_REGION_HEADER);
+  heap_remove_free(h);
+  total_heap_size -= h->size;
+  h->magic = 0;
+  if (region->prev) {
+    region->prev->next = region->next;
+  } else {
+    heap_regions = region->next;
+  }
+  if (region->next) {
+    region->next->prev = region->prev;
+  }
+  return region;
+}
 
-  if (!(n->flags & IS_FREE)) {
+int kmalloc_init(void) {
+  void *p = vmalloc(NEW_ALLOC_SIZE);
+  if (!p) {
     return 0;
   }
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  heap_add_region(p, NEW_ALLOC_SIZE);
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+  return 1;
+}
 
-  b->size += n->size;
-  b->flags |= n->flags & IS_FINAL;
-  b->n = n->n;
-  if (n == final) {
-    final = b;
+// Called with heap_lock held. It is dropped while getting the memory
+// since that can end up reclaiming pages, which allocates.
+int add_heap_memory(size_t min_desired, struct mcs_node *node,
+                    u64 *irq_flags) {
+  min_desired += HEAP_REGION_HEADER + sizeof(MallocHeader);
+  // heap_find_free() rounds the size up to the next list.
+  min_desired += min_desired >> HEAP_SL_LOG2;
+  size_t allocation_size = max(min_desired, NEW_ALLOC_SIZE);
+  allocation_size += delta_page(allocation_size);
+  allocation_size += NEW_ALLOC_SIZE;
+  mcs_lock_release_irqrestore(&heap_lock, node, *irq_flags);
+  void *p = vmalloc(allocation_size);
+  *irq_flags = mcs_lock_acquire_irqsave(&heap_lock, node);
+  if (!p) {
+    return 0;
   }
+  heap_add_region(p, allocation_size);
   return 1;
 }
 
-#ifdef KMALLOC_DEBUG
-void *int_kmalloc(size_t s) {
-  disable_interrupts();
-  u8 *rc = kmalloc_align(s, NULL);
-  prng_get_pseudorandom(rc, s);
-  rc += align_page(s);
-  rc -= s;
+// Free heap memory above `bytes` is unmapped and its frames given back,
+// as long as that leaves at least half of `bytes` free.
+void kmalloc_set_heap_watermark(size_t bytes) {
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  heap_watermark = bytes;
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+}
 
-  void *delay = kmalloc_align(1, NULL);
-  kmalloc_align_free(delay, 1);
-  return (void *)rc;
+void kmalloc_set_hardening(enum kmalloc_hardening mode, u32 sample_rate) {
+  kmalloc_hardening = mode;
+  kmalloc_sample_rate = max(sample_rate, 1);
+  kmalloc_sample_countdown = 1;
 }
 
-void kfree(void *p) {
-  get_fast_insecure_random(align_page(p) - 0x1000, 0x1000);
-  kmalloc_align_free(p, 0x1000);
+static bool kmalloc_should_sample(size_t s) {
+  // A zero sized object would start right at the next guard page.
+  if (KMALLOC_HARDENING_SAMPLED != kmalloc_hardening || 0 == s ||
+      s > PAGE_SIZE) {
+    return false;
+  }
+  if (kmalloc_sample_countdown > 1) {
+    kmalloc_sample_countdown--;
+    return false;
+  }
+  // Random so that which allocations get sampled can't be predicted.
+  u32 r = 0;
+  if (kmalloc_sample_rate > 1) {
+    prng_get_pseudorandom((u8 *)&r, sizeof(r));
+    r %= 2 * kmalloc_sample_rate;
+  }
+  kmalloc_sample_countdown = 1 + r;
+  return true;
 }
-#else
-void *int_kmalloc(size_t s) {
-  lock_acquire(&heap_lock);
-  size_t n = s;
-  MallocHeader *free_entry = find_free_entry(s);
-  if (!free_entry) {
-    if (!add_heap_memory(s)) {
-      //      klog(LOG_ERROR, "Ran out of memory.");
-      lock_release(&heap_lock);
-      return NULL;
-    }
-    lock_release(&heap_lock);
-    return kmalloc(s);
+
+static size_t large_length(size_t s) {
+  return (s + sizeof(MallocHeader) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+static void large_defer(MallocHeader *h) {
+  h->n = atomic_load_relaxed(&large_deferred);
+  for (; !atomic_cmpxchg_weak_release(&large_deferred, &h->n, h);)
+    ;
+}
+
+// Must be called with interrupts enabled.
+static void large_free_deferred(void) {
+  if (!atomic_load_relaxed(&large_deferred)) {
+    return;
+  }
+  MallocHeader *h = atomic_xchg_acquire(&large_deferred, NULL);
+  for (; h;) {
+    MallocHeader *next = h->n;
+    vfree(h, large_length(h->size));
+    h = next;
+  }
+}
+
+static void *kmalloc_large(size_t s) {
+  large_free_deferred();
+  MallocHeader *h = vmalloc(large_length(s));
+  if (!h) {
+    return NULL;
   }
+  h->magic = MALLOC_MAGIC;
+  h->size = s;
+  h->flags = IS_LARGE;
+  h->prev = NULL;
+  h->n = NULL;
+  return (void *)(h + 1);
+}
 
-  void *rc = (void *)(free_entry + 1);
+static void *krealloc_large(MallocHeader *h, size_t size) {
+  h = vrealloc(h, large_length(h->size), large_length(size));
+  if (!h) {
+    return NULL;
+  }
+  h->size = size;
+  return (void *)(h + 1);
+}
 
-  // Create a new header
-  MallocHeader *new_entry = (MallocHeader *)((uintptr_t)rc + n);
-  new_entry->flags = free_entry->flags;
-  new_entry->n = free_entry->n;
-  new_entry->size = free_entry->size - n - sizeof(MallocHeader);
-  new_entry->magic = 0xdde51ab9410268b1;
+// Grows the block by taking from the free block after it.
+static bool heap_grow_in_place(MallocHeader *h, u32 size) {
+  MallocHeader *next = next_close_header(h);
+  if (!next || !(next->flags & IS_FREE) ||
+      h->size + sizeof(MallocHeader) + next->size < size) {
+    return false;
+  }
+  heap_remove_free(next);
+  heap_absorb(h, next);
+  heap_split(h, size);
+  return true;
+}
 
-  if (free_entry == final) {
-    final = new_entry;
+// Resizes a heap or large allocation without copying. Returns NULL if
+// that is not possible.
+static void *heap_resize(void *ptr, size_t size) {
+  MallocHeader *h = (MallocHeader *)((uintptr_t)ptr - sizeof(MallocHeader));
+  assert(h->magic == MALLOC_MAGIC);
+  if (h->flags & IS_LARGE) {
+    return krealloc_large(h, size);
+  }
+  u32 block_size = heap_block_size(size);
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  bool rc = true;
+  if (block_size <= h->size) {
+    heap_split(h, block_size);
+  } else {
+    rc = heap_grow_in_place(h, block_size);
   }
-  merge_headers(new_entry);
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+  return rc ? ptr : NULL;
+}
 
-  // Modify the free entry
-  free_entry->size = n;
-  free_entry->flags = 0;
-  free_entry->n = new_entry;
-  free_entry->magic = 0xdde51ab9410268b1;
-  lock_release(&heap_lock);
+static void *kmalloc_unprofiled(size_t s, u32 flags) {
+  bool atomic = (flags & KMALLOC_ATOMIC);
+  if (!atomic && kmalloc_should_sample(s)) {
+    void *rc = guard_alloc(s);
+    if (rc) {
+      return rc;
+    }
+  }
+  if (s <= SLAB_MAX_OBJECT_SIZE) {
+    return slab_alloc(s, flags);
+  }
+  if (s > HEAP_MAX_ALLOCATION) {
+    return NULL;
+  }
+  if (s >= KMALLOC_LARGE_SIZE) {
+    // Always maps new pages.
+    return atomic ? NULL : kmalloc_large(s);
+  }
+  u32 size = heap_block_size(s);
+
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  MallocHeader *h;
+  for (; !(h = heap_find_free(size));) {
+    // Growing the heap maps pages, the atomic path only takes what the
+    // heap already has.
+    if (atomic || !add_heap_memory(size, &node, &irq_flags)) {
+      //      klog(LOG_ERROR, "Ran out of memory.");
+      mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+      return NULL;
+    }
+  }
+  h->flags &= ~IS_FREE;
+  heap_split(h, size);
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+  return (void *)(h + 1);
+}
+
+// With KMALLOC_ATOMIC it can be called from interrupt handlers, it then
+// never reclaims memory or waits for the code it interrupted. It fails
+// if there is no memory at hand.
+void *kmalloc_flags(size_t s, u32 flags) {
+  void *rc = kmalloc_unprofiled(s, flags);
+  if (rc && alloc_profile_enabled) {
+    alloc_profile_alloc(rc, s);
+  }
   return rc;
 }
 
@@ -231,33 +589,76 @@ void kfree(void *p) {
   if (!p) {
     return;
   }
+  if (alloc_profile_enabled) {
+    alloc_profile_free(p);
+  }
+  if (guard_owns(p)) {
+    guard_free(p);
+    return;
+  }
+  if (slab_owns(p)) {
+    if (KMALLOC_HARDENING_ZERO_ON_FREE == kmalloc_hardening) {
+      memset(p, 0, slab_object_size(p));
+    }
+    slab_free(p);
+    return;
+  }
 
-  lock_acquire(&heap_lock);
   MallocHeader *h = (MallocHeader *)((uintptr_t)p - sizeof(MallocHeader));
-  assert(h->magic == 0xdde51ab9410268b1);
-  assert(!(h->flags & IS_FREE));
+  assert(h->magic == MALLOC_MAGIC);
+  if (h->flags & IS_LARGE) {
+    if (KMALLOC_HARDENING_ZERO_ON_FREE == kmalloc_hardening) {
+      memset(p, 0, h->size);
+    }
+    h->magic = 0;
+    u64 irq_flags = interrupts_save_disable();
+    interrupts_restore(irq_flags);
+    if (!(irq_flags & RFLAGS_IF)) {
+      large_defer(h);
+      return;
+    }
+    large_free_deferred();
+    vfree(h, large_length(h->size));
+    return;
+  }
 
-  prng_get_pseudorandom((void *)p, h->size);
+  if (KMALLOC_HARDENING_ZERO_ON_FREE == kmalloc_hardening) {
+    memset(p, 0, h->size);
+  }
 
-  h->flags |= IS_FREE;
-  merge_headers(h);
-  lock_release(&heap_lock);
+  struct mcs_node node;
+  u64 irq_flags = mcs_lock_acquire_irqsave(&heap_lock, &node);
+  assert(!(h->flags & IS_FREE));
+  h = heap_release_block(h);
+  // Unmapping a region is left to frees that are not in an interrupt
+  // handler.
+  struct heap_region *region = NULL;
+  if (irq_flags & RFLAGS_IF) {
+    region = heap_take_region(h);
+  }
+  mcs_lock_release_irqrestore(&heap_lock, &node, irq_flags);
+  if (region) {
+    vfree(region, region->length);
+  }
+  if (irq_flags & RFLAGS_IF) {
+    large_free_deferred();
+  }
 }
-#endif // KMALLOC_DEBUG
 
 void *kmalloc(size_t s) {
-  void *rc = int_kmalloc(s);
-  if (NULL == rc) {
-    return NULL;
-  }
-  prng_get_pseudorandom((void *)rc, s);
-  return rc;
+  return kmalloc_flags(s, 0);
 }
 
 size_t get_mem_size(void *ptr) {
   if (!ptr) {
     return 0;
   }
+  if (guard_owns(ptr)) {
+    return guard_object_size(ptr);
+  }
+  if (slab_owns(ptr)) {
+    return slab_object_size(ptr);
+  }
   return ((MallocHeader *)((uintptr_t)ptr - sizeof(MallocHeader)))->size;
 }
 
@@ -269,13 +670,22 @@ void *krealloc(void *ptr, size_t size) {
   if (l == size) {
     return ptr;
   }
-  if (l > size) {
-    MallocHeader *header = (MallocHeader *)((u8 *)ptr - sizeof(MallocHeader));
-    header->size = size;
-    return ptr;
+  void *rc = NULL;
+  if (slab_owns(ptr) || guard_owns(ptr)) {
+    if (l > size) {
+      rc = ptr;
+    }
+  } else if (size <= HEAP_MAX_ALLOCATION) {
+    rc = heap_resize(ptr, size);
+  }
+  if (rc) {
+    if (alloc_profile_enabled) {
+      alloc_profile_resize(ptr, rc, size);
+    }
+    return rc;
   }
 
-  void *rc = kmalloc(size);
+  rc = kmalloc(size);
   if (!rc) {
     return NULL;
   }
@@ -311,7 +721,7 @@ void *krecalloc(void *ptr, size_t nelem, size_t elsize) {
     return kcalloc(nelem, elsize);
   }
   size_t new_size = nelem * elsize;
-  void *rc = int_kmalloc(new_size);
+  void *rc = kmalloc_flags(new_size, 0);
   if (!rc) {
     return NULL;
   }
@@ -328,7 +738,7 @@ void *kcalloc(size_t nelem, size_t elsize) {
       SIZE_MAX / nelem < elsize) {
     return NULL;
   }
-  void *rc = int_kmalloc(nelem * elsize);
+  void *rc = kmalloc_flags(nelem * elsize, 0);
   if (!rc) {
     return NULL;
   }
@@ -3,19 +3,40 @@
 #include <stddef.h>
 #include <typedefs.h>
 
+enum kmalloc_hardening {
+  KMALLOC_HARDENING_OFF,
+  // Freed memory is cleared so that stale data does not stay around.
+  KMALLOC_HARDENING_ZERO_ON_FREE,
+  // A random fraction of allocations gets guard pages and is checked for
+  // overflows and use after free.
+  KMALLOC_HARDENING_SAMPLED,
+};
+
+void kmalloc_set_hardening(enum kmalloc_hardening mode, u32 sample_rate);
+void kmalloc_set_heap_watermark(size_t bytes);
+
 void *kmalloc_align(size_t s, void **physical);
 void kmalloc_align_free(void *p, size_t s);
 
 void kmalloc_allocate_heap(void);
 
 void kmalloc_scan(void);
+void kmalloc_dump_stats(void);
+
+// Flags for kmalloc_flags().
+// For interrupt handlers and code running with interrupts disabled.
+// Memory is never reclaimed and no lock held by interrupted code is
+// waited for, so the allocation fails more easily.
+#define KMALLOC_ATOMIC (1 << 0)
 
 void *kmalloc(size_t s);
+void *kmalloc_flags(size_t s, u32 flags);
 void *krealloc(void *ptr, size_t size);
 void *kreallocarray(void *ptr, size_t nmemb, size_t size);
 void *kallocarray(size_t nmemb, size_t size);
 void *kcalloc(size_t nelem, size_t elsize);
 void *krecalloc(void *ptr, size_t nelem, size_t elsize);
 void kfree(void *p);
+size_t get_mem_size(void *ptr);
 int kmalloc_init(void);
 #endif
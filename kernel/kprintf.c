@@ -381,11 +381,14 @@ void context_serial_write(struct print_context *ctx, const char *s, int l) {
 struct print_context serial_context = {.data = NULL,
                                        .write = context_serial_write};
 
-lock_t serial_kprintf_lock;
+// Held for as long as printing takes, so waiters queue up. Interrupt
+// handlers print as well.
+struct mcs_lock serial_kprintf_lock;
 int vkprintf(const char *format, va_list ap) {
-  lock_acquire(&serial_kprintf_lock);
+  struct mcs_node node;
+  u64 flags = mcs_lock_acquire_irqsave(&serial_kprintf_lock, &node);
   int rc = vkcprintf(&serial_context, format, ap);
-  lock_release(&serial_kprintf_lock);
+  mcs_lock_release_irqrestore(&serial_kprintf_lock, &node, flags);
   return rc;
 }
 
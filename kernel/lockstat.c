@@ -0,0 +1,271 @@
+// Calls the real lock functions.
+#define LOCK_IMPLEMENTATION
+#include <lock.h>
+#ifdef LOCKSTAT
+#include <arch/amd64/idt.h>
+#include <arch/amd64/msr.h>
+#include <atomic.h>
+#include <kprintf.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Statistics are kept per call site, the place in the source where a
+// lock is acquired. All locks taken at one site are counted together,
+// such as every mempool lock in mempool_alloc().
+//
+// The hold time is measured from the acquisition to the release of a
+// lock, wherever that is. The time of the acquisition is kept in a
+// second table keyed by the address of the lock, from the acquisition
+// until the release. Only the holder writes to its entry. Released
+// entries are marked as deleted rather than unused, so that the search
+// for an entry further along does not stop at them.
+
+#define LOCKSTAT_SITES 512
+#define LOCKSTAT_HELD 1024
+#define LOCKSTAT_DUMP_SITES 16
+
+struct lockstat_site {
+  // NULL if the entry is unused, set last.
+  const char *file;
+  const char *name;
+  u32 line;
+  u64 acquisitions;
+  u64 contended;
+  u64 wait_cycles;
+  u64 wait_max;
+  u64 hold_max;
+};
+
+// In place of a lock in a released entry.
+#define LOCKSTAT_HELD_DELETED ((void *)1)
+
+struct lockstat_held {
+  // NULL if the entry has never been used.
+  void *lock;
+  struct lockstat_site *site;
+  u64 acquired;
+};
+
+struct lockstat_site lockstat_sites[LOCKSTAT_SITES];
+struct lockstat_held lockstat_held[LOCKSTAT_HELD];
+// Only for adding sites.
+lock_t lockstat_site_lock;
+// Acquisitions that did not fit in one of the tables.
+u64 lockstat_dropped = 0;
+
+static void update_max(u64 *max, u64 value) {
+  u64 current = atomic_load_relaxed(max);
+  for (; value > current;) {
+    if (atomic_cmpxchg_relaxed(max, &current, value)) {
+      return;
+    }
+  }
+}
+
+static struct lockstat_site *site_get(const char *name, const char *file,
+                                      u32 line) {
+  u64 hash = ((uintptr_t)file >> 3) * 31 + line;
+  for (u32 i = 0; i < LOCKSTAT_SITES; i++) {
+    struct lockstat_site *site = &lockstat_sites[(hash + i) % LOCKSTAT_SITES];
+    const char *site_file = atomic_load_acquire(&site->file);
+    if (!site_file) {
+      // Might be called from an interrupt handler.
+      u64 flags = interrupts_save_disable();
+      lock_acquire(&lockstat_site_lock);
+      site_file = site->file;
+      if (!site_file) {
+        site->name = name;
+        site->line = line;
+        atomic_store_release(&site->file, file);
+        site_file = file;
+      }
+      lock_release(&lockstat_site_lock);
+      interrupts_restore(flags);
+    }
+    if (site_file == file && site->line == line) {
+      return site;
+    }
+  }
+  return NULL;
+}
+
+// A lock that is being acquired has no entry yet.
+static struct lockstat_held *held_claim(void *lock) {
+  u64 hash = (uintptr_t)lock >> 3;
+  for (u32 i = 0; i < LOCKSTAT_HELD; i++) {
+    struct lockstat_held *held = &lockstat_held[(hash + i) % LOCKSTAT_HELD];
+    void *entry_lock = atomic_load_relaxed(&held->lock);
+    if (entry_lock && LOCKSTAT_HELD_DELETED != entry_lock) {
+      continue;
+    }
+    if (atomic_cmpxchg_acquire(&held->lock, &entry_lock, lock)) {
+      return held;
+    }
+  }
+  return NULL;
+}
+
+static struct lockstat_held *held_find(void *lock) {
+  u64 hash = (uintptr_t)lock >> 3;
+  for (u32 i = 0; i < LOCKSTAT_HELD; i++) {
+    struct lockstat_held *held = &lockstat_held[(hash + i) % LOCKSTAT_HELD];
+    void *entry_lock = atomic_load_acquire(&held->lock);
+    if (!entry_lock) {
+      return NULL;
+    }
+    if (entry_lock == lock) {
+      return held;
+    }
+  }
+  return NULL;
+}
+
+// Called with the lock held.
+static void acquired(void *lock, const char *name, const char *file,
+                     u32 line, bool contended, u64 start) {
+  u64 now = rdtsc();
+  struct lockstat_site *site = site_get(name, file, line);
+  if (!site) {
+    atomic_fetch_add_relaxed(&lockstat_dropped, 1);
+    return;
+  }
+  u64 wait = now - start;
+  atomic_fetch_add_relaxed(&site->acquisitions, 1);
+  if (contended) {
+    atomic_fetch_add_relaxed(&site->contended, 1);
+  }
+  atomic_fetch_add_relaxed(&site->wait_cycles, wait);
+  update_max(&site->wait_max, wait);
+
+  struct lockstat_held *held = held_claim(lock);
+  if (!held) {
+    // Only the hold time is lost.
+    atomic_fetch_add_relaxed(&lockstat_dropped, 1);
+    return;
+  }
+  held->site = site;
+  held->acquired = now;
+}
+
+// Called with the lock still held.
+static void released(void *lock) {
+  struct lockstat_held *held = held_find(lock);
+  if (!held) {
+    return;
+  }
+  update_max(&held->site->hold_max, rdtsc() - held->acquired);
+  atomic_store_release(&held->lock, LOCKSTAT_HELD_DELETED);
+}
+
+// The ticket lock is free if the ticket being served, the low half, is
+// the next one to be handed out.
+static bool ticket_contended(lock_t *lock) {
+  u32 value = atomic_load_relaxed(lock);
+  return (value >> 16) != (value & 0xFFFF);
+}
+
+void lockstat_lock_acquire(lock_t *lock, const char *name, const char *file,
+                           u32 line) {
+  u64 start = rdtsc();
+  bool contended = ticket_contended(lock);
+  lock_acquire(lock);
+  acquired(lock, name, file, line, contended, start);
+}
+
+void lockstat_lock_release(lock_t *lock) {
+  released(lock);
+  lock_release(lock);
+}
+
+u64 lockstat_lock_acquire_irqsave(lock_t *lock, const char *name,
+                                  const char *file, u32 line) {
+  u64 flags = interrupts_save_disable();
+  lockstat_lock_acquire(lock, name, file, line);
+  return flags;
+}
+
+void lockstat_lock_release_irqrestore(lock_t *lock, u64 flags) {
+  lockstat_lock_release(lock);
+  interrupts_restore(flags);
+}
+
+void lockstat_mcs_lock_acquire(struct mcs_lock *lock, struct mcs_node *node,
+                               const char *name, const char *file, u32 line) {
+  u64 start = rdtsc();
+  bool contended = (NULL != atomic_load_relaxed(&lock->tail));
+  mcs_lock_acquire(lock, node);
+  acquired(lock, name, file, line, contended, start);
+}
+
+void lockstat_mcs_lock_release(struct mcs_lock *lock, struct mcs_node *node) {
+  released(lock);
+  mcs_lock_release(lock, node);
+}
+
+u64 lockstat_mcs_lock_acquire_irqsave(struct mcs_lock *lock,
+                                      struct mcs_node *node, const char *name,
+                                      const char *file, u32 line) {
+  u64 flags = interrupts_save_disable();
+  lockstat_mcs_lock_acquire(lock, node, name, file, line);
+  return flags;
+}
+
+void lockstat_mcs_lock_release_irqrestore(struct mcs_lock *lock,
+                                          struct mcs_node *node, u64 flags) {
+  lockstat_mcs_lock_release(lock, node);
+  interrupts_restore(flags);
+}
+
+// Keeps the sites, only the counters start over.
+void lockstat_reset(void) {
+  for (u32 i = 0; i < LOCKSTAT_SITES; i++) {
+    struct lockstat_site *site = &lockstat_sites[i];
+    atomic_store_relaxed(&site->acquisitions, 0);
+    atomic_store_relaxed(&site->contended, 0);
+    atomic_store_relaxed(&site->wait_cycles, 0);
+    atomic_store_relaxed(&site->wait_max, 0);
+    atomic_store_relaxed(&site->hold_max, 0);
+  }
+  atomic_store_relaxed(&lockstat_dropped, 0);
+}
+
+// The site with the most wait cycles that is not done yet.
+static struct lockstat_site *dump_next_site(bool *done) {
+  struct lockstat_site *best = NULL;
+  u32 best_index = 0;
+  for (u32 i = 0; i < LOCKSTAT_SITES; i++) {
+    struct lockstat_site *site = &lockstat_sites[i];
+    if (done[i] || !atomic_load_acquire(&site->file) ||
+        0 == site->acquisitions) {
+      continue;
+    }
+    if (!best || site->wait_cycles > best->wait_cycles) {
+      best = site;
+      best_index = i;
+    }
+  }
+  if (best) {
+    done[best_index] = true;
+  }
+  return best;
+}
+
+// Prints the sites that waited the longest. The counters keep changing
+// while they are printed.
+void lockstat_dump(void) {
+  kprintf("lockstat: dropped: %ld\n", lockstat_dropped);
+  bool done[LOCKSTAT_SITES] = {0};
+  for (u32 n = 0; n < LOCKSTAT_DUMP_SITES; n++) {
+    struct lockstat_site *site = dump_next_site(done);
+    if (!site) {
+      break;
+    }
+    kprintf("%s at %s:%d\n", site->name, site->file, site->line);
+    kprintf("  acquisitions: %ld contended: %ld\n", site->acquisitions,
+            site->contended);
+    kprintf("  wait cycles: %ld avg: %ld max: %ld hold max: %ld\n",
+            site->wait_cycles, site->wait_cycles / site->acquisitions,
+            site->wait_max, site->hold_max);
+  }
+}
+#endif // LOCKSTAT
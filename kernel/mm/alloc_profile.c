@@ -0,0 +1,325 @@
+#include <arch/amd64/msr.h>
+#include <kmalloc.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <math.h>
+#include <mm/alloc_profile.h>
+#include <mm/slab.h>
+#include <stdint.h>
+#include <string.h>
+
+// Sampled allocations are attributed to the stack that made them. Each
+// sampled object is tracked until it is freed, so that the free can be
+// attributed to the same site and the lifetime of the object measured.
+//
+// The stack is found by following the frame pointers, which is why the
+// kernel is built with -fno-omit-frame-pointer.
+
+#define ALLOC_PROFILE_DEPTH 4
+#define ALLOC_PROFILE_SITES 256
+#define ALLOC_PROFILE_OBJECTS 2048
+#define ALLOC_PROFILE_NONE 0xFFFF
+// Bucket 0 is below 2^16 cycles, every following one covers 16 times
+// as many.
+#define ALLOC_PROFILE_AGE_BUCKETS 8
+#define ALLOC_PROFILE_DUMP_SITES 16
+// A frame further away than this from the one before is not trusted.
+#define ALLOC_PROFILE_MAX_FRAME 0x10000
+
+struct stack_frame {
+  struct stack_frame *rbp;
+  uintptr_t rip;
+};
+
+struct alloc_profile_site {
+  // 0 if the entry is unused.
+  u64 hash;
+  uintptr_t stack[ALLOC_PROFILE_DEPTH];
+  u64 allocations;
+  u64 frees;
+  u64 bytes;
+  u64 freed_bytes;
+  u64 lifetimes[ALLOC_PROFILE_AGE_BUCKETS];
+};
+
+struct alloc_profile_object {
+  // NULL if the entry is unused.
+  void *p;
+  u64 tsc;
+  u32 size;
+  u16 site;
+  // Next object in the same bucket, or in the free list.
+  u16 next;
+};
+
+// Taken with interrupts disabled, kmalloc_flags() and kfree() can be
+// called from interrupt handlers.
+lock_t alloc_profile_lock;
+
+bool alloc_profile_enabled = false;
+u32 alloc_profile_rate = 1;
+// Not atomic, a lost update only moves the next sample.
+u32 alloc_profile_countdown = 1;
+// Samples that did not fit in the tables.
+u64 alloc_profile_dropped = 0;
+
+struct alloc_profile_site alloc_profile_sites[ALLOC_PROFILE_SITES];
+struct alloc_profile_object alloc_profile_objects[ALLOC_PROFILE_OBJECTS];
+u16 alloc_profile_buckets[ALLOC_PROFILE_OBJECTS];
+u16 alloc_profile_free_object = ALLOC_PROFILE_NONE;
+u32 alloc_profile_live_objects = 0;
+
+// Profiles every `sample_rate`th allocation. Anything collected before
+// is thrown away.
+void alloc_profile_start(u32 sample_rate) {
+  u64 flags = lock_acquire_irqsave(&alloc_profile_lock);
+  memset(alloc_profile_sites, 0, sizeof(alloc_profile_sites));
+  for (u32 i = 0; i < ALLOC_PROFILE_OBJECTS; i++) {
+    alloc_profile_buckets[i] = ALLOC_PROFILE_NONE;
+    alloc_profile_objects[i].p = NULL;
+    alloc_profile_objects[i].next =
+        (i + 1 < ALLOC_PROFILE_OBJECTS) ? i + 1 : ALLOC_PROFILE_NONE;
+  }
+  alloc_profile_free_object = 0;
+  alloc_profile_live_objects = 0;
+  alloc_profile_dropped = 0;
+  alloc_profile_rate = max(sample_rate, 1);
+  alloc_profile_countdown = 1;
+  alloc_profile_enabled = true;
+  lock_release_irqrestore(&alloc_profile_lock, flags);
+}
+
+// What was collected stays around for alloc_profile_dump().
+void alloc_profile_stop(void) {
+  alloc_profile_enabled = false;
+}
+
+// Collects the return addresses of the frames after the first `skip`
+// ones. The walk stops at anything that does not look like a frame
+// further up the same stack.
+static void stack_walk(struct stack_frame *frame, uintptr_t *stack,
+                       u32 skip) {
+  u32 i = 0;
+  for (; i < ALLOC_PROFILE_DEPTH;) {
+    if (skip > 0) {
+      skip--;
+    } else {
+      stack[i++] = frame->rip;
+    }
+    struct stack_frame *next = frame->rbp;
+    if (next <= frame || ((uintptr_t)next & 7) ||
+        (uintptr_t)next - (uintptr_t)frame > ALLOC_PROFILE_MAX_FRAME) {
+      break;
+    }
+    frame = next;
+  }
+  for (; i < ALLOC_PROFILE_DEPTH; i++) {
+    stack[i] = 0;
+  }
+}
+
+static u64 stack_hash(const uintptr_t *stack) {
+  u64 hash = 0xcbf29ce484222325;
+  for (u32 i = 0; i < ALLOC_PROFILE_DEPTH; i++) {
+    hash ^= stack[i];
+    hash *= 0x100000001b3;
+  }
+  // 0 marks unused sites.
+  return hash | 1;
+}
+
+// Called with alloc_profile_lock held.
+static u16 site_get(const uintptr_t *stack) {
+  u64 hash = stack_hash(stack);
+  for (u32 i = 0; i < ALLOC_PROFILE_SITES; i++) {
+    u16 index = (hash + i) % ALLOC_PROFILE_SITES;
+    struct alloc_profile_site *site = &alloc_profile_sites[index];
+    if (0 == site->hash) {
+      site->hash = hash;
+      memcpy(site->stack, stack, sizeof(site->stack));
+      return index;
+    }
+    if (site->hash == hash &&
+        0 == memcmp(site->stack, stack, sizeof(site->stack))) {
+      return index;
+    }
+  }
+  return ALLOC_PROFILE_NONE;
+}
+
+static u16 *object_bucket(void *p) {
+  return &alloc_profile_buckets[((uintptr_t)p >> 4) % ALLOC_PROFILE_OBJECTS];
+}
+
+// Called with alloc_profile_lock held. Takes the object out of its
+// bucket, returns ALLOC_PROFILE_NONE if it is not tracked.
+static u16 object_unlink(void *p) {
+  u16 *link = object_bucket(p);
+  for (; ALLOC_PROFILE_NONE != *link;
+       link = &alloc_profile_objects[*link].next) {
+    u16 index = *link;
+    if (alloc_profile_objects[index].p == p) {
+      *link = alloc_profile_objects[index].next;
+      return index;
+    }
+  }
+  return ALLOC_PROFILE_NONE;
+}
+
+static void object_link(u16 index) {
+  u16 *bucket = object_bucket(alloc_profile_objects[index].p);
+  alloc_profile_objects[index].next = *bucket;
+  *bucket = index;
+}
+
+static u32 age_bucket(u64 cycles) {
+  u32 bucket = 0;
+  for (cycles >>= 16; cycles && bucket < ALLOC_PROFILE_AGE_BUCKETS - 1;
+       cycles >>= 4) {
+    bucket++;
+  }
+  return bucket;
+}
+
+// Called by kmalloc_flags() when profiling is enabled.
+void alloc_profile_alloc(void *p, size_t size) {
+  if (alloc_profile_countdown > 1) {
+    alloc_profile_countdown--;
+    return;
+  }
+  alloc_profile_countdown = alloc_profile_rate;
+
+  // Skips the frame of this function, the stack starts in kmalloc_flags()
+  // or whichever of its callers it was inlined into.
+  uintptr_t stack[ALLOC_PROFILE_DEPTH];
+  stack_walk(__builtin_frame_address(0), stack, 1);
+  u64 now = rdtsc();
+
+  u64 flags = lock_acquire_irqsave(&alloc_profile_lock);
+  u16 site = site_get(stack);
+  u16 index = alloc_profile_free_object;
+  if (ALLOC_PROFILE_NONE == site || ALLOC_PROFILE_NONE == index) {
+    alloc_profile_dropped++;
+    lock_release_irqrestore(&alloc_profile_lock, flags);
+    return;
+  }
+  struct alloc_profile_object *object = &alloc_profile_objects[index];
+  alloc_profile_free_object = object->next;
+  object->p = p;
+  object->tsc = now;
+  object->size = size;
+  object->site = site;
+  object_link(index);
+  alloc_profile_live_objects++;
+
+  alloc_profile_sites[site].allocations++;
+  alloc_profile_sites[site].bytes += size;
+  lock_release_irqrestore(&alloc_profile_lock, flags);
+}
+
+// Called by krealloc() when the allocation was resized without going
+// through kmalloc() and kfree().
+void alloc_profile_resize(void *old, void *p, size_t size) {
+  if (0 == alloc_profile_live_objects) {
+    return;
+  }
+  u64 flags = lock_acquire_irqsave(&alloc_profile_lock);
+  u16 index = object_unlink(old);
+  if (ALLOC_PROFILE_NONE != index) {
+    struct alloc_profile_object *object = &alloc_profile_objects[index];
+    struct alloc_profile_site *site = &alloc_profile_sites[object->site];
+    site->freed_bytes += object->size;
+    site->bytes += size;
+    object->p = p;
+    object->size = size;
+    object_link(index);
+  }
+  lock_release_irqrestore(&alloc_profile_lock, flags);
+}
+
+// Called by kfree() when profiling is enabled.
+void alloc_profile_free(void *p) {
+  if (0 == alloc_profile_live_objects) {
+    return;
+  }
+  u64 now = rdtsc();
+  u64 flags = lock_acquire_irqsave(&alloc_profile_lock);
+  u16 index = object_unlink(p);
+  if (ALLOC_PROFILE_NONE != index) {
+    struct alloc_profile_object *object = &alloc_profile_objects[index];
+    struct alloc_profile_site *site = &alloc_profile_sites[object->site];
+    site->frees++;
+    site->freed_bytes += object->size;
+    site->lifetimes[age_bucket(now - object->tsc)]++;
+    object->p = NULL;
+    object->next = alloc_profile_free_object;
+    alloc_profile_free_object = index;
+    alloc_profile_live_objects--;
+  }
+  lock_release_irqrestore(&alloc_profile_lock, flags);
+}
+
+static void dump_histogram(const char *name, const u64 *buckets) {
+  kprintf("  %s:", name);
+  for (u32 i = 0; i < ALLOC_PROFILE_AGE_BUCKETS; i++) {
+    kprintf(" %ld", buckets[i]);
+  }
+  kprintf("\n");
+}
+
+// Called with alloc_profile_lock held. Returns the site with the most
+// live bytes that is not in `done`, or ALLOC_PROFILE_NONE.
+static u16 dump_next_site(const bool *done) {
+  u16 best = ALLOC_PROFILE_NONE;
+  u64 best_live = 0;
+  for (u16 i = 0; i < ALLOC_PROFILE_SITES; i++) {
+    struct alloc_profile_site *site = &alloc_profile_sites[i];
+    if (0 == site->hash || done[i]) {
+      continue;
+    }
+    u64 live = site->bytes - site->freed_bytes;
+    if (ALLOC_PROFILE_NONE == best || live > best_live) {
+      best = i;
+      best_live = live;
+    }
+  }
+  return best;
+}
+
+// Prints the sites holding the most live memory, followed by the heap
+// and size class statistics.
+void alloc_profile_dump(void) {
+  u64 now = rdtsc();
+  u64 flags = lock_acquire_irqsave(&alloc_profile_lock);
+  kprintf("alloc_profile: sample rate: %d, live objects: %d, dropped: %ld\n",
+          alloc_profile_rate, alloc_profile_live_objects,
+          alloc_profile_dropped);
+  kprintf("alloc_profile: age buckets start at 2^16 cycles, x16 each\n");
+  u64 ages[ALLOC_PROFILE_AGE_BUCKETS] = {0};
+  for (u32 i = 0; i < ALLOC_PROFILE_OBJECTS; i++) {
+    if (alloc_profile_objects[i].p) {
+      ages[age_bucket(now - alloc_profile_objects[i].tsc)]++;
+    }
+  }
+  dump_histogram("live ages", ages);
+
+  bool done[ALLOC_PROFILE_SITES] = {0};
+  for (u32 n = 0; n < ALLOC_PROFILE_DUMP_SITES; n++) {
+    u16 index = dump_next_site(done);
+    if (ALLOC_PROFILE_NONE == index) {
+      break;
+    }
+    done[index] = true;
+    struct alloc_profile_site *site = &alloc_profile_sites[index];
+    kprintf("site %x %x %x %x\n", site->stack[0], site->stack[1],
+            site->stack[2], site->stack[3]);
+    kprintf("  allocs: %ld frees: %ld bytes: %ld live: %ld\n",
+            site->allocations, site->frees, site->bytes,
+            site->bytes - site->freed_bytes);
+    dump_histogram("lifetimes", site->lifetimes);
+  }
+  lock_release_irqrestore(&alloc_profile_lock, flags);
+
+  kmalloc_dump_stats();
+  kmem_cache_dump_stats();
+}
@@ -0,0 +1,15 @@
+#ifndef ALLOC_PROFILE_H
+#define ALLOC_PROFILE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <typedefs.h>
+
+extern bool alloc_profile_enabled;
+
+void alloc_profile_start(u32 sample_rate);
+void alloc_profile_stop(void);
+void alloc_profile_alloc(void *p, size_t size);
+void alloc_profile_resize(void *old, void *p, size_t size);
+void alloc_profile_free(void *p);
+void alloc_profile_dump(void);
+#endif // ALLOC_PROFILE_H
@@ -0,0 +1,114 @@
+#include <math.h>
+#include <mm/arena.h>
+#include <mm/vmalloc.h>
+#include <mmu.h>
+#include <stdint.h>
+
+// Every allocation is aligned to this.
+#define ARENA_ALIGN 16
+
+// Chunks double in size starting at ARENA_MIN_CHUNK up to
+// ARENA_MAX_CHUNK, larger allocations get a chunk of their own.
+#define ARENA_MIN_CHUNK 0x4000
+#define ARENA_MAX_CHUNK 0x100000
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t length;
+};
+
+static uintptr_t arena_align(uintptr_t p) {
+  return (p + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+}
+
+static uintptr_t chunk_start(struct arena_chunk *chunk) {
+  return arena_align((uintptr_t)(chunk + 1));
+}
+
+static void arena_use_chunk(struct arena *arena, struct arena_chunk *chunk) {
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->current = chunk_start(chunk);
+  arena->end = (uintptr_t)chunk + chunk->length;
+}
+
+void arena_create(struct arena *arena, void *seed, size_t seed_length) {
+  arena->seed = seed;
+  arena->seed_length = seed_length;
+  arena->chunks = NULL;
+  arena->spare = NULL;
+  arena->current = (uintptr_t)seed;
+  arena->end = (uintptr_t)seed + seed_length;
+}
+
+static void *arena_alloc_slow(struct arena *arena, size_t size) {
+  // The chunk length is rounded up to whole pages below.
+  if (size > SIZE_MAX - arena_align(sizeof(struct arena_chunk)) - PAGE_SIZE) {
+    return NULL;
+  }
+  size_t needed = arena_align(sizeof(struct arena_chunk)) + size;
+  struct arena_chunk *spare = arena->spare;
+  if (spare && spare->length >= needed) {
+    arena->spare = NULL;
+    arena_use_chunk(arena, spare);
+  } else {
+    size_t length = ARENA_MIN_CHUNK;
+    if (arena->chunks) {
+      length = min(arena->chunks->length * 2, ARENA_MAX_CHUNK);
+    }
+    length = max(length, needed);
+    length = (length + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    struct arena_chunk *chunk = vmalloc(length);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->length = length;
+    arena_use_chunk(arena, chunk);
+  }
+  void *p = (void *)arena->current;
+  arena->current = arena_align(arena->current + size);
+  return p;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  // Every allocation gets its own address, an arena that has no memory
+  // yet would otherwise return its NULL `current`.
+  if (0 == size) {
+    size = 1;
+  }
+  uintptr_t p = arena_align(arena->current);
+  if (p > arena->end || size > arena->end - p) {
+    return arena_alloc_slow(arena, size);
+  }
+  arena->current = p + size;
+  return (void *)p;
+}
+
+// Frees everything allocated from the arena. The newest chunk is kept
+// around since it is the largest one.
+void arena_reset(struct arena *arena) {
+  struct arena_chunk *chunk = arena->chunks;
+  if (chunk) {
+    if (arena->spare) {
+      vfree(arena->spare, arena->spare->length);
+    }
+    arena->spare = chunk;
+    chunk = chunk->next;
+  }
+  for (; chunk;) {
+    struct arena_chunk *next = chunk->next;
+    vfree(chunk, chunk->length);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->current = (uintptr_t)arena->seed;
+  arena->end = (uintptr_t)arena->seed + arena->seed_length;
+}
+
+void arena_destroy(struct arena *arena) {
+  arena_reset(arena);
+  if (arena->spare) {
+    vfree(arena->spare, arena->spare->length);
+    arena->spare = NULL;
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <stdint.h>
+
+struct arena_chunk;
+
+// Bump allocator for short lived work where everything is freed at
+// once. An arena has a single owner and does no locking.
+struct arena {
+  uintptr_t current;
+  uintptr_t end;
+  // Optional caller provided buffer, usually on the stack, that is
+  // used before any pages are allocated.
+  void *seed;
+  size_t seed_length;
+  // Newest first.
+  struct arena_chunk *chunks;
+  // Kept across arena_reset() so a reused arena does not allocate.
+  struct arena_chunk *spare;
+};
+
+void arena_create(struct arena *arena, void *seed, size_t seed_length);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+#endif // ARENA_H
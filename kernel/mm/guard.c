@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <mm/guard.h>
+#include <mmu.h>
+#include <stdint.h>
+#include <string.h>
+#include <typedefs.h>
+
+// Sampled allocations are given a page of their own with an unmapped
+// guard page on each side. The object is placed at the end of its page
+// so running past it faults right away. The rest of the page is filled
+// with GUARD_POISON, which is checked on free to catch smaller writes
+// before the object or into the alignment padding after it. Freed pages
+// are unmapped so use after free faults as well, and slots are reused
+// round robin to keep freed pages unmapped for as long as possible.
+
+#define GUARD_BASE ((uintptr_t)0xffffffe000000000)
+#define GUARD_NUM_SLOTS 256
+#define GUARD_POISON 0xAB
+
+struct guard_slot {
+  u32 size;
+  bool used;
+  // Set while the page is being unmapped, the slot stays used until then.
+  bool freeing;
+};
+
+lock_t guard_lock;
+
+struct guard_slot guard_slots[GUARD_NUM_SLOTS];
+size_t guard_cursor = 0;
+
+// Slot i has its guard page at 2 * i and its object page at 2 * i + 1.
+static uintptr_t guard_page(size_t slot) {
+  return GUARD_BASE + (2 * slot + 1) * PAGE_SIZE;
+}
+
+static uintptr_t guard_object(size_t slot) {
+  u32 size = (guard_slots[slot].size + 7) & ~7;
+  return guard_page(slot) + PAGE_SIZE - size;
+}
+
+bool guard_owns(void *p) {
+  uintptr_t address = (uintptr_t)p;
+  return address >= GUARD_BASE &&
+         address < GUARD_BASE + 2 * GUARD_NUM_SLOTS * PAGE_SIZE;
+}
+
+static size_t guard_slot_from_address(void *p) {
+  return ((uintptr_t)p - GUARD_BASE) / (2 * PAGE_SIZE);
+}
+
+// Returns NULL once every slot is in use, or for sizes that do not
+// fit in a slot. The caller then uses the normal allocator.
+void *guard_alloc(size_t size) {
+  if (0 == size || size > PAGE_SIZE) {
+    return NULL;
+  }
+  u64 flags = lock_acquire_irqsave(&guard_lock);
+  size_t slot = GUARD_NUM_SLOTS;
+  for (size_t i = 0; i < GUARD_NUM_SLOTS; i++) {
+    size_t n = (guard_cursor + i) % GUARD_NUM_SLOTS;
+    if (!guard_slots[n].used) {
+      slot = n;
+      break;
+    }
+  }
+  if (GUARD_NUM_SLOTS == slot) {
+    lock_release_irqrestore(&guard_lock, flags);
+    return NULL;
+  }
+  guard_slots[slot].used = true;
+  guard_slots[slot].freeing = false;
+  guard_slots[slot].size = size;
+  guard_cursor = slot + 1;
+  lock_release_irqrestore(&guard_lock, flags);
+
+  // Getting frames may reclaim memory, which itself allocates.
+  mmu_map_pages((void *)guard_page(slot), PAGE_SIZE);
+  memset((void *)guard_page(slot), GUARD_POISON, PAGE_SIZE);
+  return (void *)guard_object(slot);
+}
+
+static bool guard_is_poisoned(uintptr_t start, uintptr_t end) {
+  for (const u8 *p = (const u8 *)start; p < (const u8 *)end; p++) {
+    if (GUARD_POISON != *p) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void guard_free(void *p) {
+  u64 flags = lock_acquire_irqsave(&guard_lock);
+  size_t slot = guard_slot_from_address(p);
+  struct guard_slot *s = &guard_slots[slot];
+  if (!s->used || s->freeing || (uintptr_t)p != guard_object(slot)) {
+    kprintf("guard: invalid or double free of: %x\n", p);
+    assert(0);
+  }
+  uintptr_t page = guard_page(slot);
+  uintptr_t end = (uintptr_t)p + s->size;
+  if (!guard_is_poisoned(page, (uintptr_t)p) ||
+      !guard_is_poisoned(end, page + PAGE_SIZE)) {
+    kprintf("guard: memory around object %x of size %d was overwritten\n", p,
+            s->size);
+    assert(0);
+  }
+  s->freeing = true;
+  lock_release_irqrestore(&guard_lock, flags);
+
+  // Not under guard_lock, the other cores have to take the shootdown
+  // IPI and may be waiting for the lock with interrupts disabled.
+  mmu_unmap_pages((void *)page, PAGE_SIZE);
+
+  flags = lock_acquire_irqsave(&guard_lock);
+  s->used = false;
+  lock_release_irqrestore(&guard_lock, flags);
+}
+
+size_t guard_object_size(void *p) {
+  return guard_slots[guard_slot_from_address(p)].size;
+}
+
+// Called from the page fault handler. Returns true if the fault was
+// caused by a sampled allocation and has been reported.
+bool guard_report_fault(void *address) {
+  if (!guard_owns(address)) {
+    return false;
+  }
+  uintptr_t a = (uintptr_t)address;
+  size_t slot = guard_slot_from_address(address);
+  struct guard_slot *s = &guard_slots[slot];
+  if (a >= guard_page(slot)) {
+    kprintf("guard: use after free at %x, object: %x size: %d\n", a,
+            guard_object(slot), s->size);
+    return true;
+  }
+  // A guard page, the object right before it is the most likely cause.
+  if (slot > 0 && guard_slots[slot - 1].used) {
+    kprintf("guard: out of bounds access at %x, %d bytes past object %x\n",
+            a, a - (guard_page(slot - 1) + PAGE_SIZE), guard_object(slot - 1));
+    return true;
+  }
+  kprintf("guard: out of bounds access at %x, %d bytes before object %x\n", a,
+          guard_page(slot) - a, guard_object(slot));
+  return true;
+}
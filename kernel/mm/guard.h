@@ -0,0 +1,11 @@
+#ifndef GUARD_H
+#define GUARD_H
+#include <stdbool.h>
+#include <stddef.h>
+
+void *guard_alloc(size_t size);
+void guard_free(void *p);
+bool guard_owns(void *p);
+size_t guard_object_size(void *p);
+bool guard_report_fault(void *address);
+#endif // GUARD_H
@@ -0,0 +1,297 @@
+#include <arch/amd64/msr.h>
+#include <arch/amd64/tlb.h>
+#include <assert.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <mm/ksm.h>
+#include <mmu.h>
+#include <stddef.h>
+#include <string.h>
+#include <task.h>
+
+#define KSM_BUCKETS 256
+// Cycles between two scans started by ksm_scan_periodic().
+#define KSM_SCAN_INTERVAL 100000000
+
+struct ksm_node {
+  u64 hash;
+  void *frame;
+  // Only used by unstable nodes. The page entry that mapped the frame
+  // when it was hashed.
+  uintptr_t *page;
+  struct ksm_node *next;
+};
+
+extern struct task *task_head;
+
+lock_t ksm_lock;
+
+// Frames that have been merged. KSM keeps a reference of its own to
+// these so they can't be freed and reused while they are in the table.
+struct ksm_node *stable_nodes[KSM_BUCKETS];
+// Candidates found during the current pass. Their contents may change
+// at any point so they are only merged after a full compare.
+struct ksm_node *unstable_nodes[KSM_BUCKETS];
+
+u32 ksm_pages_per_scan = 64;
+
+// Earliest time stamp at which ksm_scan_periodic() scans again.
+u64 ksm_next_scan = 0;
+
+struct task *ksm_task = NULL;
+uintptr_t ksm_cursor = MMU_TASK_REGION_START;
+
+struct ksm_stats ksm_last_scan;
+struct ksm_stats ksm_total;
+
+void ksm_set_rate(u32 pages_per_scan) {
+  lock_acquire(&ksm_lock);
+  ksm_pages_per_scan = pages_per_scan;
+  lock_release(&ksm_lock);
+}
+
+static u64 ksm_hash_frame(void *frame) {
+  const u64 *p = mmu_map_frames(frame, PAGE_SIZE);
+  u64 hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(u64); i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3;
+    hash ^= hash >> 29;
+  }
+  mmu_unmap_frames((void *)p, PAGE_SIZE);
+  return hash;
+}
+
+static bool ksm_frames_equal(void *a, void *b) {
+  void *x = mmu_map_frames(a, PAGE_SIZE);
+  void *y = mmu_map_frames(b, PAGE_SIZE);
+  bool rc = (0 == memcmp(x, y, PAGE_SIZE));
+  mmu_unmap_frames(x, PAGE_SIZE);
+  mmu_unmap_frames(y, PAGE_SIZE);
+  return rc;
+}
+
+// Has to be done before comparing the contents, otherwise the page could
+// be written to after the compare but before the merge. Page entries are
+// only changed with compare and swap, the CPU sets the accessed and
+// dirty bits in them at any time.
+static uintptr_t ksm_write_protect(uintptr_t *page) {
+  uintptr_t entry = atomic_load_relaxed(page);
+  for (; entry & PAGE_FLAG_WRITABLE;) {
+    uintptr_t protected = (entry & ~PAGE_FLAG_WRITABLE) | PAGE_FLAG_COW;
+    if (atomic_cmpxchg_seq_cst(page, &entry, protected)) {
+      return protected;
+    }
+  }
+  return entry;
+}
+
+// Only undo the protection if the page has not been touched since, a
+// write would already have given it a private copy.
+static void ksm_write_unprotect(uintptr_t *page, uintptr_t original,
+                                uintptr_t protected) {
+  atomic_cmpxchg_seq_cst(page, &protected, original);
+}
+
+static bool ksm_merge(uintptr_t *page, void *frame, void *shared_frame,
+                      struct ksm_stats *stats) {
+  uintptr_t original = atomic_load_relaxed(page);
+  uintptr_t protected = ksm_write_protect(page);
+  // Also covers a candidate the caller protected, no core may still
+  // write to either frame through a stale entry.
+  tlb_shootdown();
+  if (!ksm_frames_equal(frame, shared_frame)) {
+    stats->hash_collisions++;
+    ksm_write_unprotect(page, original, protected);
+    return false;
+  }
+  mmu_frame_share(shared_frame);
+  uintptr_t entry = atomic_load_relaxed(page);
+  for (;;) {
+    // Reads may have set the accessed bit since, anything else means the
+    // page was written to or moved out.
+    if ((entry & ~PAGE_FLAG_ACCESSED) != (protected & ~PAGE_FLAG_ACCESSED)) {
+      mmu_frame_release(shared_frame);
+      return false;
+    }
+    uintptr_t merged = (uintptr_t)shared_frame | (entry & 0xFFF);
+    if (atomic_cmpxchg_seq_cst(page, &entry, merged)) {
+      break;
+    }
+  }
+  // The old frame is only given back once no core can reach it.
+  tlb_shootdown();
+  mmu_frame_release(frame);
+  stats->pages_merged++;
+  return true;
+}
+
+static void ksm_scan_page(uintptr_t *page, struct ksm_stats *stats) {
+  void *frame = (void *)(*page & ~(0xFFF));
+  if ((*page & PAGE_FLAG_COW) && mmu_frame_references(frame) > 0) {
+    // Already shared
+    return;
+  }
+  stats->pages_scanned++;
+
+  u64 hash = ksm_hash_frame(frame);
+  size_t bucket = hash % KSM_BUCKETS;
+
+  for (struct ksm_node *n = stable_nodes[bucket]; n; n = n->next) {
+    if (n->hash != hash) {
+      continue;
+    }
+    if (ksm_merge(page, frame, n->frame, stats)) {
+      return;
+    }
+  }
+
+  for (struct ksm_node **p = &unstable_nodes[bucket]; *p; p = &(*p)->next) {
+    struct ksm_node *n = *p;
+    if (n->hash != hash || n->page == page) {
+      continue;
+    }
+    // The candidate could have been remapped since it was hashed.
+    if (!(*n->page & PAGE_FLAG_PRESENT) ||
+        (*n->page & ~(0xFFF)) != (uintptr_t)n->frame) {
+      continue;
+    }
+    uintptr_t original = *n->page;
+    uintptr_t protected = ksm_write_protect(n->page);
+    if (!ksm_merge(page, frame, n->frame, stats)) {
+      ksm_write_unprotect(n->page, original, protected);
+      continue;
+    }
+    // Reference held by KSM itself while the frame is stable.
+    mmu_frame_share(n->frame);
+
+    *p = n->next;
+    n->page = NULL;
+    n->next = stable_nodes[bucket];
+    stable_nodes[bucket] = n;
+    return;
+  }
+
+  struct ksm_node *n = kmalloc(sizeof(struct ksm_node));
+  if (!n) {
+    return;
+  }
+  n->hash = hash;
+  n->frame = frame;
+  n->page = page;
+  n->next = unstable_nodes[bucket];
+  unstable_nodes[bucket] = n;
+}
+
+static void ksm_end_pass(void) {
+  for (size_t i = 0; i < KSM_BUCKETS; i++) {
+    for (struct ksm_node *n = unstable_nodes[i]; n;) {
+      struct ksm_node *next = n->next;
+      kfree(n);
+      n = next;
+    }
+    unstable_nodes[i] = NULL;
+
+    // Once at most one mapping is left the frame is no longer shared.
+    // Dropping the KSM reference lets that mapping write to it directly
+    // instead of making a copy.
+    for (struct ksm_node **p = &stable_nodes[i]; *p;) {
+      struct ksm_node *n = *p;
+      if (mmu_frame_references(n->frame) > 1) {
+        p = &n->next;
+        continue;
+      }
+      mmu_frame_release(n->frame);
+      *p = n->next;
+      kfree(n);
+    }
+  }
+}
+
+// Scans at most `ksm_pages_per_scan` pages, continuing from where the
+// last scan stopped. Meant to be called periodically, the rate decides
+// how much CPU time is traded for memory.
+void ksm_scan(void) {
+  lock_acquire(&ksm_lock);
+  struct ksm_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  u64 start = rdtsc();
+
+  for (u32 budget = ksm_pages_per_scan; budget > 0;) {
+    if (!ksm_task) {
+      ksm_task = task_head;
+      ksm_cursor = MMU_TASK_REGION_START;
+      if (!ksm_task) {
+        break;
+      }
+    }
+    uintptr_t *page = mmu_next_present_page(ksm_task->directory, &ksm_cursor,
+                                            MMU_TASK_REGION_END);
+    if (!page) {
+      ksm_task = ksm_task->next;
+      ksm_cursor = MMU_TASK_REGION_START;
+      if (!ksm_task) {
+        ksm_end_pass();
+        break;
+      }
+      continue;
+    }
+    ksm_cursor += PAGE_SIZE;
+    ksm_scan_page(page, &stats);
+    budget--;
+  }
+
+  stats.cycles = rdtsc() - start;
+  ksm_last_scan = stats;
+  ksm_total.pages_scanned += stats.pages_scanned;
+  ksm_total.pages_merged += stats.pages_merged;
+  ksm_total.hash_collisions += stats.hash_collisions;
+  ksm_total.cycles += stats.cycles;
+  lock_release(&ksm_lock);
+}
+
+// Called from the idle loops. Scans once every KSM_SCAN_INTERVAL cycles,
+// on whichever core gets there first.
+void ksm_scan_periodic(void) {
+  u64 now = rdtsc();
+  u64 next = atomic_load_relaxed(&ksm_next_scan);
+  if (now < next || !atomic_cmpxchg_relaxed(&ksm_next_scan, &next,
+                                            now + KSM_SCAN_INTERVAL)) {
+    return;
+  }
+  ksm_scan();
+}
+
+void ksm_get_stats(struct ksm_stats *last_scan, struct ksm_stats *total) {
+  lock_acquire(&ksm_lock);
+  PTR_ASSIGN(last_scan, ksm_last_scan);
+  PTR_ASSIGN(total, ksm_total);
+  lock_release(&ksm_lock);
+}
+
+void ksm_dump_stats(void) {
+  lock_acquire(&ksm_lock);
+  u64 shared = 0;
+  u64 sharing = 0;
+  for (size_t i = 0; i < KSM_BUCKETS; i++) {
+    for (struct ksm_node *n = stable_nodes[i]; n; n = n->next) {
+      shared++;
+      // Every reference except the one KSM holds is a mapping.
+      sharing += mmu_frame_references(n->frame);
+    }
+  }
+  kprintf("ksm: pages_per_scan: %d\n", ksm_pages_per_scan);
+  kprintf("ksm: frames shared: %ld, pages sharing them: %ld\n", shared,
+          sharing);
+  kprintf("ksm: last scan: scanned: %ld merged: %ld collisions: %ld "
+          "cycles: %ld\n",
+          ksm_last_scan.pages_scanned, ksm_last_scan.pages_merged,
+          ksm_last_scan.hash_collisions, ksm_last_scan.cycles);
+  kprintf("ksm: total: scanned: %ld merged: %ld collisions: %ld "
+          "cycles: %ld\n",
+          ksm_total.pages_scanned, ksm_total.pages_merged,
+          ksm_total.hash_collisions, ksm_total.cycles);
+  lock_release(&ksm_lock);
+}
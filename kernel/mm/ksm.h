@@ -0,0 +1,18 @@
+#ifndef KSM_H
+#define KSM_H
+#include <typedefs.h>
+
+struct ksm_stats {
+  u64 pages_scanned;
+  u64 pages_merged;
+  // The hash matched but the full compare did not.
+  u64 hash_collisions;
+  u64 cycles;
+};
+
+void ksm_set_rate(u32 pages_per_scan);
+void ksm_scan(void);
+void ksm_scan_periodic(void);
+void ksm_get_stats(struct ksm_stats *last_scan, struct ksm_stats *total);
+void ksm_dump_stats(void);
+#endif // KSM_H
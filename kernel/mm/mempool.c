@@ -0,0 +1,129 @@
+#include <kmalloc.h>
+#include <lock.h>
+#include <mm/mempool.h>
+#include <mm/slab.h>
+#include <stdbool.h>
+
+// A pool keeps `min_nr` objects allocated up front for paths that have
+// to make progress when memory is tight, such as writing pages out. The
+// reserve is only used once the normal allocator fails and is refilled
+// by frees before anything goes back to the allocator.
+//
+// The allocator is first asked with KMALLOC_ATOMIC so that the reserve
+// is used before memory gets reclaimed, reclaiming is what the callers
+// are usually busy with. Only when the reserve is empty as well is the
+// allocator allowed to reclaim.
+
+struct mempool {
+  lock_t lock;
+  // NULL if the objects come from kmalloc.
+  struct kmem_cache *cache;
+  size_t size;
+  u32 min_nr;
+  u32 count;
+  void **reserve;
+};
+
+static void *mempool_alloc_object(struct mempool *pool, u32 flags) {
+  if (pool->cache) {
+    return kmem_cache_alloc_flags(pool->cache, flags);
+  }
+  return kmalloc_flags(pool->size, flags);
+}
+
+static void mempool_free_object(struct mempool *pool, void *p) {
+  if (pool->cache) {
+    kmem_cache_free(pool->cache, p);
+    return;
+  }
+  kfree(p);
+}
+
+static struct mempool *mempool_create_common(struct kmem_cache *cache,
+                                             size_t size, u32 min_nr) {
+  struct mempool *pool = kmalloc(sizeof(struct mempool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->lock = 0;
+  pool->cache = cache;
+  pool->size = size;
+  pool->min_nr = min_nr;
+  pool->count = 0;
+  pool->reserve = kallocarray(min_nr, sizeof(void *));
+  if (!pool->reserve) {
+    kfree(pool);
+    return NULL;
+  }
+  for (; pool->count < min_nr; pool->count++) {
+    void *p = mempool_alloc_object(pool, 0);
+    if (!p) {
+      for (; pool->count > 0;) {
+        mempool_free_object(pool, pool->reserve[--pool->count]);
+      }
+      kfree(pool->reserve);
+      kfree(pool);
+      return NULL;
+    }
+    pool->reserve[pool->count] = p;
+  }
+  return pool;
+}
+
+// Reserves `min_nr` objects of the cache.
+struct mempool *mempool_create(struct kmem_cache *cache, u32 min_nr) {
+  return mempool_create_common(cache, 0, min_nr);
+}
+
+// Reserves `min_nr` kmalloc allocations of `size` bytes.
+struct mempool *mempool_create_kmalloc(size_t size, u32 min_nr) {
+  return mempool_create_common(NULL, size, min_nr);
+}
+
+// Only returns NULL if the allocator failed and the reserve is empty.
+// With KMALLOC_ATOMIC the allocator is not asked again once the reserve
+// is empty, so it never reclaims.
+void *mempool_alloc_flags(struct mempool *pool, u32 flags) {
+  void *p = mempool_alloc_object(pool, KMALLOC_ATOMIC);
+  if (p) {
+    return p;
+  }
+  u64 irq_flags = lock_acquire_irqsave(&pool->lock);
+  if (pool->count > 0) {
+    p = pool->reserve[--pool->count];
+  }
+  lock_release_irqrestore(&pool->lock, irq_flags);
+  if (p || (flags & KMALLOC_ATOMIC)) {
+    return p;
+  }
+  return mempool_alloc_object(pool, 0);
+}
+
+void *mempool_alloc(struct mempool *pool) {
+  return mempool_alloc_flags(pool, 0);
+}
+
+// Objects of a kmalloc pool may also come from kmalloc() directly, they
+// only refill the reserve if they are large enough.
+void mempool_free(struct mempool *pool, void *p) {
+  if (!p) {
+    return;
+  }
+  if (pool->count < pool->min_nr &&
+      (pool->cache || get_mem_size(p) >= pool->size)) {
+    u64 flags = lock_acquire_irqsave(&pool->lock);
+    bool kept = (pool->count < pool->min_nr);
+    if (kept) {
+      pool->reserve[pool->count++] = p;
+    }
+    lock_release_irqrestore(&pool->lock, flags);
+    if (kept) {
+      return;
+    }
+  }
+  mempool_free_object(pool, p);
+}
+
+u32 mempool_reserved(struct mempool *pool) {
+  return pool->count;
+}
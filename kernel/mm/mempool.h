@@ -0,0 +1,15 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+#include <stddef.h>
+#include <typedefs.h>
+
+struct kmem_cache;
+struct mempool;
+
+struct mempool *mempool_create(struct kmem_cache *cache, u32 min_nr);
+struct mempool *mempool_create_kmalloc(size_t size, u32 min_nr);
+void *mempool_alloc(struct mempool *pool);
+void *mempool_alloc_flags(struct mempool *pool, u32 flags);
+void mempool_free(struct mempool *pool, void *p);
+u32 mempool_reserved(struct mempool *pool);
+#endif // MEMPOOL_H
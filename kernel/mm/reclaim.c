@@ -0,0 +1,298 @@
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/tlb.h>
+#include <atomic.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <math.h>
+#include <mm/reclaim.h>
+#include <mm/swap.h>
+#include <mm/zram.h>
+#include <mmu.h>
+#include <task.h>
+
+// There is no list of pages to keep in LRU order, instead it is
+// approximated by a clock going over the task address spaces. The CPU
+// sets the accessed bit whenever a page is used, a page that has it set
+// when the hand passes gets a second chance and the bit cleared. Pages
+// that still have it cleared on the next pass are cold.
+
+// Flags that are kept while the page is out of memory and restored once
+// it comes back.
+#define SWAPPED_KEPT_FLAGS 0x3FE
+
+// Pages that zram did not take are collected and written to swap in
+// clusters of up to this many.
+#define RECLAIM_MAX_CLUSTER 16
+
+struct reclaim_candidate {
+  uintptr_t *page;
+  // The entry before it was write protected.
+  uintptr_t entry;
+  uintptr_t protected;
+};
+
+void flush_tlb(void);
+extern struct task *task_head;
+
+lock_t reclaim_lock;
+bool reclaim_active = false;
+// The task that is reclaiming, storing pages may allocate memory which
+// ends up in reclaim_frames() again.
+struct task *reclaim_owner = NULL;
+// Bumped whenever a reclaim finishes, `reclaim_freed` is what it freed.
+u64 reclaim_generation = 0;
+size_t reclaim_freed = 0;
+
+struct task *reclaim_task = NULL;
+uintptr_t reclaim_cursor = MMU_TASK_REGION_START;
+
+struct reclaim_candidate reclaim_cluster[RECLAIM_MAX_CLUSTER];
+size_t reclaim_cluster_count = 0;
+
+// Replaces the entry if it is still `expected`, apart from the accessed
+// bit that reads may have set since. The CPU changes entries at any
+// time, so they are only replaced with compare and swap.
+static bool reclaim_replace(uintptr_t *page, uintptr_t expected,
+                            uintptr_t new_entry) {
+  uintptr_t entry = atomic_load_relaxed(page);
+  for (;;) {
+    if ((entry & ~PAGE_FLAG_ACCESSED) != (expected & ~PAGE_FLAG_ACCESSED)) {
+      return false;
+    }
+    if (atomic_cmpxchg_seq_cst(page, &entry, new_entry)) {
+      return true;
+    }
+  }
+}
+
+static bool reclaim_clear_accessed(uintptr_t *page) {
+  uintptr_t entry = atomic_load_relaxed(page);
+  for (; entry & PAGE_FLAG_ACCESSED;) {
+    if (atomic_cmpxchg_seq_cst(page, &entry, entry & ~PAGE_FLAG_ACCESSED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes the pending cluster to swap. Returns the number of frames
+// freed.
+static size_t reclaim_write_cluster(void) {
+  size_t count = reclaim_cluster_count;
+  if (0 == count) {
+    return 0;
+  }
+  reclaim_cluster_count = 0;
+
+  void *frames[RECLAIM_MAX_CLUSTER];
+  for (size_t i = 0; i < count; i++) {
+    frames[i] = (void *)(reclaim_cluster[i].entry & ~(0xFFF));
+  }
+  u64 slot;
+  bool written = swap_write(frames, count, &slot);
+
+  bool swapped[RECLAIM_MAX_CLUSTER];
+  for (size_t i = 0; i < count; i++) {
+    struct reclaim_candidate *c = &reclaim_cluster[i];
+    swapped[i] = false;
+    if (!written) {
+      reclaim_replace(c->page, c->protected, c->entry);
+      continue;
+    }
+    uintptr_t entry = (c->entry & SWAPPED_KEPT_FLAGS) | PAGE_FLAG_SWAPPED |
+                      PAGE_FLAG_ON_DISK | ((slot + i) << 12);
+    if (!reclaim_replace(c->page, c->protected, entry)) {
+      // Written to while waiting, the copy on disk is stale.
+      swap_free(slot + i);
+      continue;
+    }
+    swapped[i] = true;
+  }
+  if (!written) {
+    return 0;
+  }
+
+  // The frames are only given back once no core can reach them.
+  tlb_shootdown();
+  size_t freed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (swapped[i]) {
+      mmu_frame_release(frames[i]);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+// Returns true if the frame was freed. Pages that have to go to disk
+// are only queued, they are freed once the cluster is written.
+static bool reclaim_evict(uintptr_t *page) {
+  uintptr_t entry = atomic_load_relaxed(page);
+  void *frame = (void *)(entry & ~(0xFFF));
+  // Other mappings still point to shared frames.
+  if (mmu_frame_references(frame) > 0) {
+    return false;
+  }
+
+  // Writes while the page is being stored are caught by the copy-on-write
+  // handler, which makes the page writable again.
+  uintptr_t protected = entry;
+  if (entry & PAGE_FLAG_WRITABLE) {
+    protected = (entry & ~PAGE_FLAG_WRITABLE) | PAGE_FLAG_COW;
+    if (!reclaim_replace(page, entry, protected)) {
+      return false;
+    }
+    // No core may keep writing through a stale entry.
+    tlb_shootdown();
+  }
+
+  void *virtual = mmu_map_frames(frame, PAGE_SIZE);
+  u64 handle;
+  bool stored = zram_store(virtual, &handle);
+  mmu_unmap_frames(virtual, PAGE_SIZE);
+
+  if (!stored) {
+    if (!swap_is_enabled()) {
+      reclaim_replace(page, protected, entry);
+      return false;
+    }
+    struct reclaim_candidate *c = &reclaim_cluster[reclaim_cluster_count++];
+    c->page = page;
+    c->entry = entry;
+    c->protected = protected;
+    return false;
+  }
+
+  uintptr_t swapped =
+      (entry & SWAPPED_KEPT_FLAGS) | PAGE_FLAG_SWAPPED | (handle << 12);
+  if (!reclaim_replace(page, protected, swapped)) {
+    // Written to while it was being stored.
+    zram_free(handle);
+    return false;
+  }
+  tlb_shootdown();
+  mmu_frame_release(frame);
+  return true;
+}
+
+// Waits for the reclaim another task is running. Returns the number of
+// frames it freed.
+static size_t reclaim_wait(u64 generation) {
+  for (; atomic_load_acquire(&reclaim_generation) == generation;) {
+    task_schedule();
+    cpu_relax();
+  }
+  lock_acquire(&reclaim_lock);
+  size_t freed = reclaim_freed;
+  lock_release(&reclaim_lock);
+  return freed;
+}
+
+// Tries to free `count` frames by moving cold pages out of memory.
+// Returns the number of frames that were freed. If another task is
+// already reclaiming it waits for that one instead.
+size_t reclaim_frames(size_t count) {
+  struct task *self = this_cpu_read(current_task);
+  lock_acquire(&reclaim_lock);
+  if (reclaim_active) {
+    bool nested = self == reclaim_owner;
+    u64 generation = reclaim_generation;
+    lock_release(&reclaim_lock);
+    if (nested) {
+      return 0;
+    }
+    return reclaim_wait(generation);
+  }
+  reclaim_active = true;
+  reclaim_owner = self;
+  lock_release(&reclaim_lock);
+
+  // Pages read ahead from swap are the cheapest to get rid of.
+  size_t freed = swap_cache_shrink(count);
+  size_t cluster_size = min(swap_cluster_size(), RECLAIM_MAX_CLUSTER);
+  bool accessed_cleared = false;
+  // Two full passes are enough to find every cold page.
+  for (u32 passes = 0; freed < count && passes < 2;) {
+    if (!reclaim_task) {
+      reclaim_task = task_head;
+      reclaim_cursor = MMU_TASK_REGION_START;
+      if (!reclaim_task) {
+        break;
+      }
+    }
+    uintptr_t *page = mmu_next_present_page(
+        reclaim_task->directory, &reclaim_cursor, MMU_TASK_REGION_END);
+    if (!page) {
+      reclaim_task = reclaim_task->next;
+      reclaim_cursor = MMU_TASK_REGION_START;
+      if (!reclaim_task) {
+        passes++;
+        // Queued pages would otherwise be found again.
+        freed += reclaim_write_cluster();
+        // The CPU will not set the accessed bit again until the old
+        // entry is gone from the TLB.
+        if (accessed_cleared) {
+          tlb_shootdown();
+          accessed_cleared = false;
+        }
+      }
+      continue;
+    }
+    reclaim_cursor += PAGE_SIZE;
+
+    if (reclaim_clear_accessed(page)) {
+      accessed_cleared = true;
+      continue;
+    }
+    if (reclaim_evict(page)) {
+      freed++;
+    }
+    if (reclaim_cluster_count == cluster_size) {
+      freed += reclaim_write_cluster();
+    }
+  }
+  freed += reclaim_write_cluster();
+  if (accessed_cleared) {
+    tlb_shootdown();
+  }
+
+  lock_acquire(&reclaim_lock);
+  reclaim_active = false;
+  reclaim_owner = NULL;
+  reclaim_freed = freed;
+  atomic_store_release(&reclaim_generation, reclaim_generation + 1);
+  lock_release(&reclaim_lock);
+  return freed;
+}
+
+// Brings back a page marked with PAGE_FLAG_SWAPPED.
+bool reclaim_fault_in(uintptr_t *page) {
+  uintptr_t entry = *page;
+  u64 handle = entry >> 12;
+
+  if (entry & PAGE_FLAG_ON_DISK) {
+    void *frame = swap_read(handle);
+    if (!frame) {
+      return false;
+    }
+    *page =
+        (uintptr_t)frame | (entry & SWAPPED_KEPT_FLAGS) | PAGE_FLAG_PRESENT;
+    flush_tlb();
+    return true;
+  }
+
+  void *frame = get_frame(true, 1);
+  void *virtual = mmu_map_frames(frame, PAGE_SIZE);
+  bool loaded = zram_load(handle, virtual);
+  mmu_unmap_frames(virtual, PAGE_SIZE);
+  if (!loaded) {
+    kprintf("reclaim: failed to load page with handle: %x\n", handle);
+    mmu_frame_release(frame);
+    return false;
+  }
+  zram_free(handle);
+
+  *page = (uintptr_t)frame | (entry & SWAPPED_KEPT_FLAGS) | PAGE_FLAG_PRESENT;
+  flush_tlb();
+  return true;
+}
@@ -0,0 +1,9 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+size_t reclaim_frames(size_t count);
+bool reclaim_fault_in(uintptr_t *page);
+#endif // RECLAIM_H
@@ -0,0 +1,521 @@
+#include <arch/amd64/idt.h>
+#include <arch/amd64/msr.h>
+#include <arch/amd64/smp.h>
+#include <assert.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <math.h>
+#include <mm/slab.h>
+#include <mmu.h>
+#include <stdint.h>
+#include <string.h>
+#include <typedefs.h>
+
+// Objects of up to SLAB_MAX_OBJECT_SIZE bytes are rounded up to a size
+// class, powers of two and three quarters of them, and carved out of
+// fixed size slabs. Every slab holds objects of a single class.
+//
+// Slabs live in their own part of the kernel address space, this way
+// the slab of an object is found from its address alone and no header
+// is needed in front of it. The descriptors are kept separately so the
+// larger classes do not lose an object to them.
+//
+// Every slab is owned by a core and only that core touches its lists,
+// with interrupts disabled instead of a lock. Objects freed by another
+// core are pushed onto the owner's remote free queue, which the owner
+// takes back once it runs out of objects. slab_lock only protects the
+// pool of unused slabs and is only taken with interrupts disabled, so
+// interrupt handlers can allocate and free too.
+//
+// KMALLOC_ATOMIC allocations can't map new slabs, getting frames may
+// reclaim memory. Instead every core keeps a few mapped slabs in
+// reserve for them, which are refilled by the next allocation that is
+// allowed to map slabs.
+//
+// The kmalloc size classes are the first caches, kmem_cache_create()
+// adds more for objects that are allocated often. Their objects can
+// have a constructor, which only runs when an object is first carved
+// out of a slab. Objects have to be freed in their constructed state.
+// The free list link of such objects is kept behind the object, where
+// it does not overwrite anything the constructor set up.
+
+#define SLAB_BASE ((uintptr_t)0xffffffd000000000)
+#define SLAB_SIZE 0x4000
+// Enough to cover all of physical memory.
+#define SLAB_MAX_SLABS 4096
+// Empty slabs kept around per class before their frames are given back.
+#define SLAB_MAX_EMPTY 1
+// Mapped slabs kept per core for KMALLOC_ATOMIC allocations.
+#define SLAB_ATOMIC_RESERVE 2
+
+#define SLAB_NUM_CLASSES 17
+#define SLAB_MAX_CACHES 64
+#define SLAB_UNUSED 0xFF
+
+// The free list link of an object, at `link` bytes into it.
+struct slab_object {
+  struct slab_object *next;
+};
+
+struct slab {
+  struct slab *prev;
+  struct slab *next;
+  struct slab_object *free;
+  // Objects from this index onwards have never been handed out.
+  u16 carved;
+  u16 in_use;
+  u8 class;
+  u32 owner;
+};
+
+struct slab_class {
+  struct slab *partial;
+  struct slab *full;
+  struct slab *empty;
+  u32 num_empty;
+};
+
+// Counted per core so the fast path does not share cache lines.
+struct slab_cpu_stats {
+  u64 allocations;
+  u64 frees;
+};
+
+struct kmem_cache {
+  const char *name;
+  // Distance between objects in a slab.
+  u32 size;
+  // Offset of the free list link, zero unless there is a constructor.
+  u32 link;
+  void (*ctor)(void *object);
+  // Updated atomically.
+  u64 slabs;
+};
+
+struct slab_cpu {
+  struct slab_class classes[SLAB_MAX_CACHES];
+  struct slab_cpu_stats stats[SLAB_MAX_CACHES];
+  // Objects freed by other cores, pushed with compare and swap.
+  struct slab_object *remote_free;
+  struct slab *reserve[SLAB_ATOMIC_RESERVE];
+  u32 num_reserve;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define KMALLOC_CACHE(n) {.name = "kmalloc-" #n, .size = n}
+
+struct kmem_cache slab_caches[SLAB_MAX_CACHES] = {
+    KMALLOC_CACHE(16),   KMALLOC_CACHE(24),   KMALLOC_CACHE(32),
+    KMALLOC_CACHE(48),   KMALLOC_CACHE(64),   KMALLOC_CACHE(96),
+    KMALLOC_CACHE(128),  KMALLOC_CACHE(192),  KMALLOC_CACHE(256),
+    KMALLOC_CACHE(384),  KMALLOC_CACHE(512),  KMALLOC_CACHE(768),
+    KMALLOC_CACHE(1024), KMALLOC_CACHE(1536), KMALLOC_CACHE(2048),
+    KMALLOC_CACHE(3072), KMALLOC_CACHE(4096),
+};
+u32 slab_num_caches = SLAB_NUM_CLASSES;
+
+lock_t slab_lock;
+
+struct slab slabs[SLAB_MAX_SLABS];
+// cpu_count entries, allocated at boot.
+struct slab_cpu *slab_cpus = NULL;
+
+// Slabs that have no memory behind them, linked through `next`.
+struct slab *slab_unused = NULL;
+// Slabs from this index onwards have never been used.
+u32 slab_next_unused = 0;
+
+static u8 size_to_class(size_t size) {
+  if (size <= 16) {
+    return 0;
+  }
+  // The smallest power of two that fits `size` is 1 << shift.
+  u32 shift = 64 - __builtin_clzll(size - 1);
+  u8 class = 2 * (shift - 4);
+  if (size <= ((size_t)3 << (shift - 2))) {
+    class--;
+  }
+  return class;
+}
+
+static u16 objects_per_slab(u8 class) {
+  return SLAB_SIZE / slab_caches[class].size;
+}
+
+static uintptr_t slab_address(struct slab *s) {
+  return SLAB_BASE + (s - slabs) * SLAB_SIZE;
+}
+
+static struct slab_object *object_link(u8 class, void *p) {
+  return (struct slab_object *)((uintptr_t)p + slab_caches[class].link);
+}
+
+// The link is in the same slab as its object.
+static void *link_object(struct slab_object *link) {
+  struct slab *s = &slabs[((uintptr_t)link - SLAB_BASE) / SLAB_SIZE];
+  return (void *)((uintptr_t)link - slab_caches[s->class].link);
+}
+
+static void slab_list_push(struct slab **list, struct slab *s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (*list) {
+    (*list)->prev = s;
+  }
+  *list = s;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *s) {
+  if (s->prev) {
+    s->prev->next = s->next;
+  } else {
+    *list = s->next;
+  }
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+}
+
+static void *slab_alloc_local(struct slab_cpu *cpu, u8 class) {
+  struct slab_class *c = &cpu->classes[class];
+  struct slab *s = c->partial;
+  if (!s) {
+    s = c->empty;
+    if (!s) {
+      return NULL;
+    }
+    slab_list_remove(&c->empty, s);
+    c->num_empty--;
+    slab_list_push(&c->partial, s);
+  }
+
+  void *object;
+  if (s->free) {
+    object = link_object(s->free);
+    s->free = s->free->next;
+  } else {
+    object = (void *)(slab_address(s) + s->carved * slab_caches[class].size);
+    s->carved++;
+    if (slab_caches[class].ctor) {
+      slab_caches[class].ctor(object);
+    }
+  }
+  s->in_use++;
+  cpu->stats[class].allocations++;
+  if (s->in_use == objects_per_slab(class)) {
+    slab_list_remove(&c->partial, s);
+    slab_list_push(&c->full, s);
+  }
+  return object;
+}
+
+static struct slab *slab_from_object(void *p) {
+  assert(slab_owns(p));
+  struct slab *s = &slabs[((uintptr_t)p - SLAB_BASE) / SLAB_SIZE];
+  assert(s->class < slab_num_caches);
+  assert(0 == ((uintptr_t)p - slab_address(s)) % slab_caches[s->class].size);
+  return s;
+}
+
+// Called with interrupts disabled.
+static void slab_put_unused(struct slab *s) {
+  mmu_unmap_pages((void *)slab_address(s), SLAB_SIZE);
+  lock_acquire(&slab_lock);
+  s->class = SLAB_UNUSED;
+  s->next = slab_unused;
+  slab_unused = s;
+  lock_release(&slab_lock);
+}
+
+static void slab_release(struct slab *s) {
+  atomic_fetch_sub_relaxed(&slab_caches[s->class].slabs, 1);
+  slab_put_unused(s);
+}
+
+static void slab_free_local(struct slab_cpu *cpu, struct slab *s, void *p) {
+  struct slab_class *c = &cpu->classes[s->class];
+  assert(s->in_use > 0);
+
+  struct slab_object *link = object_link(s->class, p);
+  link->next = s->free;
+  s->free = link;
+  if (s->in_use == objects_per_slab(s->class)) {
+    slab_list_remove(&c->full, s);
+    slab_list_push(&c->partial, s);
+  }
+  s->in_use--;
+  cpu->stats[s->class].frees++;
+  if (s->in_use > 0) {
+    return;
+  }
+
+  slab_list_remove(&c->partial, s);
+  if (c->num_empty < SLAB_MAX_EMPTY) {
+    slab_list_push(&c->empty, s);
+    c->num_empty++;
+    return;
+  }
+  slab_release(s);
+}
+
+static void slab_drain_remote(struct slab_cpu *cpu) {
+  struct slab_object *link = atomic_xchg_acquire(&cpu->remote_free, NULL);
+  for (; link;) {
+    struct slab_object *next = link->next;
+    void *object = link_object(link);
+    slab_free_local(cpu, slab_from_object(object), object);
+    link = next;
+  }
+}
+
+static struct slab_cpu *slab_get_cpu(void) {
+  return &slab_cpus[core_id_get()];
+}
+
+static struct slab *slab_get_unused(void) {
+  struct slab *s = slab_unused;
+  if (s) {
+    slab_unused = s->next;
+    return s;
+  }
+  if (slab_next_unused == SLAB_MAX_SLABS) {
+    return NULL;
+  }
+  return &slabs[slab_next_unused++];
+}
+
+// Called with interrupts disabled.
+static struct slab *slab_take_unused(void) {
+  lock_acquire(&slab_lock);
+  struct slab *s = slab_get_unused();
+  lock_release(&slab_lock);
+  return s;
+}
+
+// Called with interrupts disabled.
+static void slab_init(struct slab_cpu *cpu, struct slab *s, u8 class) {
+  atomic_fetch_add_relaxed(&slab_caches[class].slabs, 1);
+  s->free = NULL;
+  s->carved = 0;
+  s->in_use = 0;
+  s->class = class;
+  s->owner = cpu - slab_cpus;
+  slab_list_push(&cpu->classes[class].partial, s);
+}
+
+// Maps slabs until the reserve of the current core is full. Only called
+// where memory may be reclaimed.
+static void slab_refill_reserve(void) {
+  for (;;) {
+    u64 flags = interrupts_save_disable();
+    struct slab *s = NULL;
+    if (slab_get_cpu()->num_reserve < SLAB_ATOMIC_RESERVE) {
+      s = slab_take_unused();
+    }
+    interrupts_restore(flags);
+    if (!s) {
+      return;
+    }
+
+    mmu_map_pages((void *)slab_address(s), SLAB_SIZE);
+
+    flags = interrupts_save_disable();
+    struct slab_cpu *cpu = slab_get_cpu();
+    s->class = SLAB_UNUSED;
+    if (cpu->num_reserve < SLAB_ATOMIC_RESERVE) {
+      cpu->reserve[cpu->num_reserve++] = s;
+      s = NULL;
+    } else {
+      slab_put_unused(s);
+    }
+    interrupts_restore(flags);
+    if (s) {
+      return;
+    }
+  }
+}
+
+static void *slab_alloc_class(u8 class, u32 alloc_flags) {
+  u64 flags = interrupts_save_disable();
+  struct slab_cpu *cpu = slab_get_cpu();
+  void *object = slab_alloc_local(cpu, class);
+  if (!object && atomic_load_relaxed(&cpu->remote_free)) {
+    slab_drain_remote(cpu);
+    object = slab_alloc_local(cpu, class);
+  }
+  if (!object && (alloc_flags & KMALLOC_ATOMIC) && cpu->num_reserve > 0) {
+    slab_init(cpu, cpu->reserve[--cpu->num_reserve], class);
+    object = slab_alloc_local(cpu, class);
+  }
+  if (object || (alloc_flags & KMALLOC_ATOMIC)) {
+    interrupts_restore(flags);
+    return object;
+  }
+
+  struct slab *s = slab_take_unused();
+  interrupts_restore(flags);
+  if (!s) {
+    return NULL;
+  }
+
+  // Getting frames may reclaim memory, which itself allocates.
+  mmu_map_pages((void *)slab_address(s), SLAB_SIZE);
+
+  flags = interrupts_save_disable();
+  cpu = slab_get_cpu();
+  slab_init(cpu, s, class);
+  object = slab_alloc_local(cpu, class);
+  interrupts_restore(flags);
+  slab_refill_reserve();
+  return object;
+}
+
+// `flags` are the kmalloc flags.
+// Has to run after smp_enumerate() and before the first allocation.
+// Nothing else can allocate yet, so the memory comes from ksbrk().
+bool slab_cpus_init(void) {
+  size_t length = cpu_count * sizeof(struct slab_cpu);
+  slab_cpus = ksbrk(length);
+  if (!slab_cpus) {
+    return false;
+  }
+  memset(slab_cpus, 0, length);
+  return true;
+}
+
+void *slab_alloc(size_t size, u32 flags) {
+  assert(size <= SLAB_MAX_OBJECT_SIZE);
+  return slab_alloc_class(size_to_class(size), flags);
+}
+
+void slab_free(void *p) {
+  // The owner can't change while the object is allocated.
+  struct slab *s = slab_from_object(p);
+  u64 flags = interrupts_save_disable();
+  struct slab_cpu *cpu = slab_get_cpu();
+  if (s->owner == cpu - slab_cpus) {
+    slab_free_local(cpu, s, p);
+    interrupts_restore(flags);
+    return;
+  }
+  interrupts_restore(flags);
+
+  struct slab_object *link = object_link(s->class, p);
+  struct slab_object **queue = &slab_cpus[s->owner].remote_free;
+  link->next = atomic_load_relaxed(queue);
+  for (; !atomic_cmpxchg_weak_release(queue, &link->next, link);)
+    ;
+}
+
+bool slab_owns(void *p) {
+  uintptr_t address = (uintptr_t)p;
+  return address >= SLAB_BASE &&
+         address < SLAB_BASE + (uintptr_t)SLAB_MAX_SLABS * SLAB_SIZE;
+}
+
+size_t slab_object_size(void *p) {
+  return slab_caches[slab_from_object(p)->class].size;
+}
+
+// Objects are aligned to `align` and get constructed by `ctor`, which
+// may be NULL, before they are handed out the first time.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *)) {
+  align = max(align, sizeof(void *));
+  assert(0 == (align & (align - 1)));
+  size = max(size, sizeof(struct slab_object));
+  size = (size + align - 1) & ~(align - 1);
+  size_t link = 0;
+  if (ctor) {
+    link = size;
+    size = (size + sizeof(struct slab_object) + align - 1) & ~(align - 1);
+  }
+  if (size > SLAB_MAX_OBJECT_SIZE) {
+    return NULL;
+  }
+
+  u64 flags = lock_acquire_irqsave(&slab_lock);
+  if (SLAB_MAX_CACHES == slab_num_caches) {
+    lock_release_irqrestore(&slab_lock, flags);
+    return NULL;
+  }
+  struct kmem_cache *cache = &slab_caches[slab_num_caches];
+  cache->name = name;
+  cache->size = size;
+  cache->link = link;
+  cache->ctor = ctor;
+  cache->slabs = 0;
+  slab_num_caches++;
+  lock_release_irqrestore(&slab_lock, flags);
+  return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  return slab_alloc_class(cache - slab_caches, 0);
+}
+
+void *kmem_cache_alloc_flags(struct kmem_cache *cache, u32 flags) {
+  return slab_alloc_class(cache - slab_caches, flags);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *p) {
+  if (!p) {
+    return;
+  }
+  assert(&slab_caches[slab_from_object(p)->class] == cache);
+  slab_free(p);
+}
+
+void kmem_cache_get_stats(struct kmem_cache *cache,
+                          struct kmem_cache_stats *stats) {
+  size_t class = cache - slab_caches;
+  stats->object_size = cache->size;
+  stats->allocations = 0;
+  stats->frees = 0;
+  // The per core counters are read without stopping the other cores,
+  // the sum is only a snapshot.
+  for (size_t i = 0; i < cpu_count; i++) {
+    stats->allocations += slab_cpus[i].stats[class].allocations;
+    stats->frees += slab_cpus[i].stats[class].frees;
+  }
+  stats->active_objects = stats->allocations - stats->frees;
+  stats->slabs = atomic_load_relaxed(&cache->slabs);
+}
+
+void kmem_cache_dump_stats(void) {
+  for (size_t i = 0; i < slab_num_caches; i++) {
+    struct kmem_cache *cache = &slab_caches[i];
+    struct kmem_cache_stats stats;
+    kmem_cache_get_stats(cache, &stats);
+    if (0 == stats.allocations) {
+      continue;
+    }
+    kprintf("%s: size: %ld active: %ld slabs: %ld allocations: %ld\n",
+            cache->name, stats.object_size, stats.active_objects, stats.slabs,
+            stats.allocations);
+  }
+}
+
+#ifdef KERNEL_TEST
+// Meant to be run on every core at the same time. Since the fast path
+// shares nothing between cores the cycle count should not go up with
+// the number of cores running it.
+u64 slab_benchmark(u32 rounds) {
+  void *objects[64];
+  u64 start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    for (size_t j = 0; j < 64; j++) {
+      objects[j] = slab_alloc(16 << (j % 8), 0);
+      assert(objects[j]);
+    }
+    for (size_t j = 0; j < 64; j++) {
+      slab_free(objects[j]);
+    }
+  }
+  u64 cycles = rdtsc() - start;
+  kprintf("slab: core %d: %ld cycles per alloc and free\n", core_id_get(),
+          cycles / ((u64)rounds * 64));
+  return cycles;
+}
+#endif // KERNEL_TEST
@@ -0,0 +1,39 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <typedefs.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Anything larger goes to the general heap.
+#define SLAB_MAX_OBJECT_SIZE 4096
+
+struct kmem_cache;
+
+struct kmem_cache_stats {
+  u64 object_size;
+  u64 active_objects;
+  u64 slabs;
+  u64 allocations;
+  u64 frees;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void *kmem_cache_alloc_flags(struct kmem_cache *cache, u32 flags);
+void kmem_cache_free(struct kmem_cache *cache, void *p);
+void kmem_cache_get_stats(struct kmem_cache *cache,
+                          struct kmem_cache_stats *stats);
+void kmem_cache_dump_stats(void);
+
+bool slab_cpus_init(void);
+void *slab_alloc(size_t size, u32 flags);
+void slab_free(void *p);
+bool slab_owns(void *p);
+size_t slab_object_size(void *p);
+#ifdef KERNEL_TEST
+u64 slab_benchmark(u32 rounds);
+#endif // KERNEL_TEST
+#endif // SLAB_H
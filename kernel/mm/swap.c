@@ -0,0 +1,335 @@
+#include <assert.h>
+#include <drivers/ahci.h>
+#include <kmalloc.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <math.h>
+#include <mm/swap.h>
+#include <mmu.h>
+#include <mutex.h>
+
+// Every slot holds one page.
+#define SECTORS_PER_SLOT (PAGE_SIZE / 512)
+
+// Slots read in ahead of a fault are kept here until they are faulted
+// in or memory gets tight.
+#define SWAP_CACHE_SIZE 32
+
+// Upper limit for the cluster size, the AHCI driver may support less.
+#define SWAP_MAX_CLUSTER 16
+
+struct swap_cache_entry {
+  u64 slot;
+  void *frame;
+};
+
+// Covers the bitmap, the cache and the stats, never held across disk
+// commands.
+lock_t swap_lock;
+// Serialises the disk commands. Slots are only allocated with it held,
+// so slots being read can be freed meanwhile but not used again.
+struct mutex swap_io;
+
+bool swap_enabled = false;
+u8 swap_port;
+u64 swap_start_lba;
+u64 swap_num_slots;
+u64 *swap_bitmap = NULL;
+// Where to start looking for free slots, so that clusters written after
+// each other end up next to each other on disk.
+u64 swap_hint = 0;
+
+// Oldest entry first.
+struct swap_cache_entry swap_cache[SWAP_CACHE_SIZE];
+size_t swap_cache_used = 0;
+
+struct swap_stats swap_stats;
+
+static bool slot_used(u64 slot) {
+  return swap_bitmap[slot / 64] & ((u64)1 << (slot % 64));
+}
+
+static void slot_set(u64 slot, bool used) {
+  if (used) {
+    swap_bitmap[slot / 64] |= ((u64)1 << (slot % 64));
+  } else {
+    swap_bitmap[slot / 64] &= ~((u64)1 << (slot % 64));
+  }
+}
+
+// Uses an area of `num_slots` pages starting at `start_lba` on the AHCI
+// port as swap. Anything already stored there is overwritten.
+bool swap_init(u8 port, u64 start_lba, u64 num_slots) {
+  u64 *bitmap = kcalloc(num_slots / 64 + 1, sizeof(u64));
+  if (!bitmap) {
+    return false;
+  }
+  lock_acquire(&swap_lock);
+  assert(!swap_enabled);
+  swap_port = port;
+  swap_start_lba = start_lba;
+  swap_num_slots = num_slots;
+  swap_bitmap = bitmap;
+  swap_enabled = true;
+  lock_release(&swap_lock);
+  return true;
+}
+
+bool swap_is_enabled(void) {
+  return swap_enabled;
+}
+
+u32 swap_cluster_size(void) {
+  return min(ahci_max_frames_per_command(), SWAP_MAX_CLUSTER);
+}
+
+// Finds `count` consecutive free slots and marks them as used.
+static bool swap_alloc_slots(size_t count, u64 *first_slot) {
+  size_t run = 0;
+  for (u64 i = 0; i < swap_num_slots; i++) {
+    u64 slot = (swap_hint + i) % swap_num_slots;
+    // A run can't wrap around the end of the swap area.
+    if (0 == slot) {
+      run = 0;
+    }
+    if (slot_used(slot)) {
+      run = 0;
+      continue;
+    }
+    run++;
+    if (run < count) {
+      continue;
+    }
+    *first_slot = slot + 1 - count;
+    for (u64 j = *first_slot; j <= slot; j++) {
+      slot_set(j, true);
+    }
+    swap_hint = slot + 1;
+    swap_stats.used_slots += count;
+    return true;
+  }
+  return false;
+}
+
+static void swap_free_slot(u64 slot) {
+  assert(slot < swap_num_slots);
+  assert(slot_used(slot));
+  slot_set(slot, false);
+  swap_stats.used_slots--;
+}
+
+// Writes the physical frames to consecutive slots with a single command.
+// On success `first_slot` is the slot of the first frame.
+bool swap_write(void **frames, size_t count, u64 *first_slot) {
+  assert(count <= swap_cluster_size());
+  mutex_lock(&swap_io);
+  lock_acquire(&swap_lock);
+  bool allocated = swap_enabled && swap_alloc_slots(count, first_slot);
+  lock_release(&swap_lock);
+  if (!allocated) {
+    mutex_unlock(&swap_io);
+    return false;
+  }
+
+  u64 lba = swap_start_lba + *first_slot * SECTORS_PER_SLOT;
+  bool written = ahci_write_frames(swap_port, lba, frames, count);
+
+  lock_acquire(&swap_lock);
+  if (written) {
+    swap_stats.pages_written += count;
+    swap_stats.write_commands++;
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      swap_free_slot(*first_slot + i);
+    }
+  }
+  lock_release(&swap_lock);
+  mutex_unlock(&swap_io);
+  return written;
+}
+
+static bool swap_cache_find(u64 slot, size_t *index) {
+  for (size_t i = 0; i < swap_cache_used; i++) {
+    if (swap_cache[i].slot == slot) {
+      *index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void *swap_cache_remove(size_t index) {
+  void *frame = swap_cache[index].frame;
+  swap_cache_used--;
+  for (size_t i = index; i < swap_cache_used; i++) {
+    swap_cache[i] = swap_cache[i + 1];
+  }
+  return frame;
+}
+
+static void swap_cache_insert(u64 slot, void *frame) {
+  if (SWAP_CACHE_SIZE == swap_cache_used) {
+    mmu_frame_release(swap_cache_remove(0));
+  }
+  swap_cache[swap_cache_used].slot = slot;
+  swap_cache[swap_cache_used].frame = frame;
+  swap_cache_used++;
+}
+
+// A slot can be read ahead if it holds a page that is not already in
+// the cache.
+static bool swap_can_read_ahead(u64 slot) {
+  size_t index;
+  return slot_used(slot) && !swap_cache_find(slot, &index);
+}
+
+// Called with `swap_lock` held. Returns NULL if the slot is not cached.
+static void *swap_read_cached(u64 slot) {
+  size_t index;
+  if (!swap_cache_find(slot, &index)) {
+    return NULL;
+  }
+  void *frame = swap_cache_remove(index);
+  swap_free_slot(slot);
+  swap_stats.cache_hits++;
+  return frame;
+}
+
+// Returns a frame holding the page stored in `slot` and frees the slot.
+// Used slots around it, within the same cluster, are read with the same
+// command and kept in the swap cache since pages that were written out
+// together tend to be used together.
+void *swap_read(u64 slot) {
+  void *frame = get_frame(true, 1);
+  // Readahead only uses frames that are free right now, it should never
+  // cause other pages to be moved out.
+  void *spare[SWAP_MAX_CLUSTER];
+  size_t num_spare = 0;
+  u32 cluster = swap_cluster_size();
+  for (; num_spare < cluster - 1; num_spare++) {
+    spare[num_spare] = try_get_frame();
+    if (!spare[num_spare]) {
+      break;
+    }
+  }
+
+  // Checked again once the disk is ours, another read may have brought
+  // the slot into the cache in the meantime.
+  lock_acquire(&swap_lock);
+  assert(swap_enabled);
+  void *cached = swap_read_cached(slot);
+  lock_release(&swap_lock);
+  if (!cached) {
+    mutex_lock(&swap_io);
+    lock_acquire(&swap_lock);
+    cached = swap_read_cached(slot);
+    if (cached) {
+      lock_release(&swap_lock);
+      mutex_unlock(&swap_io);
+    }
+  }
+  if (cached) {
+    mmu_frame_release(frame);
+    for (size_t i = 0; i < num_spare; i++) {
+      mmu_frame_release(spare[i]);
+    }
+    return cached;
+  }
+
+  u64 base = slot - slot % cluster;
+  u64 end = min(base + cluster, swap_num_slots);
+  u64 first = slot;
+  u64 last = slot;
+  for (; last - first < num_spare;) {
+    if (first > base && swap_can_read_ahead(first - 1)) {
+      first--;
+    } else if (last + 1 < end && swap_can_read_ahead(last + 1)) {
+      last++;
+    } else {
+      break;
+    }
+  }
+
+  void *frames[SWAP_MAX_CLUSTER];
+  size_t used_spare = 0;
+  for (u64 s = first; s <= last; s++) {
+    frames[s - first] = (s == slot) ? frame : spare[used_spare++];
+  }
+  size_t count = last - first + 1;
+  u64 lba = swap_start_lba + first * SECTORS_PER_SLOT;
+  lock_release(&swap_lock);
+
+  bool rc = ahci_read_frames(swap_port, lba, frames, count);
+
+  lock_acquire(&swap_lock);
+  if (rc) {
+    for (u64 s = first; s <= last; s++) {
+      if (s == slot) {
+        continue;
+      }
+      // Freed while it was being read.
+      if (!swap_can_read_ahead(s)) {
+        mmu_frame_release(frames[s - first]);
+        continue;
+      }
+      swap_cache_insert(s, frames[s - first]);
+    }
+    swap_free_slot(slot);
+    swap_stats.pages_read += count;
+    swap_stats.readahead_pages += count - 1;
+    swap_stats.read_commands++;
+  } else {
+    kprintf("swap: failed to read slot: %x\n", slot);
+    used_spare = 0;
+    mmu_frame_release(frame);
+    frame = NULL;
+  }
+  lock_release(&swap_lock);
+  mutex_unlock(&swap_io);
+
+  for (size_t i = used_spare; i < num_spare; i++) {
+    mmu_frame_release(spare[i]);
+  }
+  return frame;
+}
+
+// Frees a slot whose page will never be read back.
+void swap_free(u64 slot) {
+  lock_acquire(&swap_lock);
+  size_t index;
+  if (swap_cache_find(slot, &index)) {
+    mmu_frame_release(swap_cache_remove(index));
+  }
+  swap_free_slot(slot);
+  lock_release(&swap_lock);
+}
+
+// Gives back up to `count` frames held by the swap cache, oldest first.
+// The pages are still on disk so nothing is lost.
+size_t swap_cache_shrink(size_t count) {
+  lock_acquire(&swap_lock);
+  size_t freed = 0;
+  for (; freed < count && swap_cache_used > 0; freed++) {
+    mmu_frame_release(swap_cache_remove(0));
+  }
+  lock_release(&swap_lock);
+  return freed;
+}
+
+void swap_get_stats(struct swap_stats *stats) {
+  lock_acquire(&swap_lock);
+  *stats = swap_stats;
+  lock_release(&swap_lock);
+}
+
+void swap_dump_stats(void) {
+  struct swap_stats stats;
+  swap_get_stats(&stats);
+  kprintf("swap: used slots: %ld of %ld\n", stats.used_slots, swap_num_slots);
+  kprintf("swap: written: %ld pages in %ld commands\n", stats.pages_written,
+          stats.write_commands);
+  kprintf("swap: read: %ld pages in %ld commands\n", stats.pages_read,
+          stats.read_commands);
+  kprintf("swap: readahead: %ld pages, cache hits: %ld\n",
+          stats.readahead_pages, stats.cache_hits);
+}
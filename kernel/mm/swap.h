@@ -0,0 +1,27 @@
+#ifndef SWAP_H
+#define SWAP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <typedefs.h>
+
+struct swap_stats {
+  u64 used_slots;
+  u64 pages_written;
+  u64 write_commands;
+  u64 pages_read;
+  u64 read_commands;
+  // Neighbouring slots read together with a faulting one.
+  u64 readahead_pages;
+  u64 cache_hits;
+};
+
+bool swap_init(u8 port, u64 start_lba, u64 num_slots);
+bool swap_is_enabled(void);
+u32 swap_cluster_size(void);
+bool swap_write(void **frames, size_t count, u64 *first_slot);
+void *swap_read(u64 slot);
+void swap_free(u64 slot);
+size_t swap_cache_shrink(size_t count);
+void swap_get_stats(struct swap_stats *stats);
+void swap_dump_stats(void);
+#endif // SWAP_H
@@ -0,0 +1,228 @@
+#include <assert.h>
+#include <kmalloc.h>
+#include <lock.h>
+#include <mm/vmalloc.h>
+#include <mmu.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Page granular allocations mapped into their own part of the kernel
+// address space. The free parts of it are kept as a list of ranges
+// sorted by address, neighbouring ranges are merged when an area is
+// freed so the address space can be reused. Every area is followed by
+// an unmapped guard page.
+//
+// Range nodes are allocated before vmalloc_lock is taken, allocating
+// can end up reclaiming memory which may need vmalloc itself.
+
+#define VMALLOC_START ((uintptr_t)0xffffffc000000000)
+#define VMALLOC_END ((uintptr_t)0xffffffd000000000)
+
+struct vmalloc_range {
+  uintptr_t start;
+  size_t length;
+  struct vmalloc_range *next;
+};
+
+lock_t vmalloc_lock;
+
+struct vmalloc_range *vmalloc_ranges = NULL;
+bool vmalloc_initialized = false;
+
+static size_t page_align(size_t length) {
+  return (length + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+static void vmalloc_remove_range(struct vmalloc_range **p) {
+  struct vmalloc_range *range = *p;
+  *p = range->next;
+  kfree(range);
+}
+
+// Returns 0 if there is no free range large enough.
+static uintptr_t vmalloc_reserve(size_t length) {
+  for (struct vmalloc_range **p = &vmalloc_ranges; *p; p = &(*p)->next) {
+    struct vmalloc_range *range = *p;
+    if (range->length < length) {
+      continue;
+    }
+    uintptr_t start = range->start;
+    range->start += length;
+    range->length -= length;
+    if (0 == range->length) {
+      vmalloc_remove_range(p);
+    }
+    return start;
+  }
+  return 0;
+}
+
+// Reserves exactly [start, start + length) if it is free.
+static bool vmalloc_reserve_at(uintptr_t start, size_t length) {
+  for (struct vmalloc_range **p = &vmalloc_ranges; *p; p = &(*p)->next) {
+    struct vmalloc_range *range = *p;
+    if (range->start > start) {
+      break;
+    }
+    if (range->start != start) {
+      continue;
+    }
+    if (range->length < length) {
+      return false;
+    }
+    range->start += length;
+    range->length -= length;
+    if (0 == range->length) {
+      vmalloc_remove_range(p);
+    }
+    return true;
+  }
+  return false;
+}
+
+// Returns true if `spare` was used for a new range.
+static bool vmalloc_release(uintptr_t start, size_t length,
+                            struct vmalloc_range *spare) {
+  struct vmalloc_range *prev = NULL;
+  struct vmalloc_range *next = vmalloc_ranges;
+  for (; next && next->start < start;) {
+    prev = next;
+    next = next->next;
+  }
+  if (prev && prev->start + prev->length == start) {
+    prev->length += length;
+    if (next && prev->start + prev->length == next->start) {
+      prev->length += next->length;
+      vmalloc_remove_range(&prev->next);
+    }
+    return false;
+  }
+  if (next && start + length == next->start) {
+    next->start = start;
+    next->length += length;
+    return false;
+  }
+  if (!spare) {
+    // The address space is lost but there is plenty of it.
+    return false;
+  }
+  spare->start = start;
+  spare->length = length;
+  spare->next = next;
+  if (prev) {
+    prev->next = spare;
+  } else {
+    vmalloc_ranges = spare;
+  }
+  return true;
+}
+
+static void vmalloc_give_back(uintptr_t start, size_t length) {
+  struct vmalloc_range *spare = kmalloc(sizeof(struct vmalloc_range));
+  lock_acquire(&vmalloc_lock);
+  bool used = vmalloc_release(start, length, spare);
+  lock_release(&vmalloc_lock);
+  if (!used) {
+    kfree(spare);
+  }
+}
+
+static void *vmalloc_reserve_area(size_t length) {
+  struct vmalloc_range *initial = NULL;
+  if (!vmalloc_initialized) {
+    initial = kmalloc(sizeof(struct vmalloc_range));
+    if (!initial) {
+      return NULL;
+    }
+  }
+  lock_acquire(&vmalloc_lock);
+  if (initial && !vmalloc_initialized) {
+    initial->start = VMALLOC_START;
+    initial->length = VMALLOC_END - VMALLOC_START;
+    initial->next = NULL;
+    vmalloc_ranges = initial;
+    vmalloc_initialized = true;
+    initial = NULL;
+  }
+  uintptr_t address = vmalloc_reserve(length + PAGE_SIZE);
+  lock_release(&vmalloc_lock);
+  kfree(initial);
+  return (void *)address;
+}
+
+// Every page gets a frame of its own, they are not physically
+// contiguous.
+void *vmalloc(size_t length) {
+  length = page_align(length);
+  void *address = vmalloc_reserve_area(length);
+  if (!address) {
+    return NULL;
+  }
+  // Mapped outside of vmalloc_lock since getting frames may reclaim
+  // memory, which itself allocates.
+  mmu_map_pages(address, length);
+  return address;
+}
+
+// Same as vmalloc() but backed by physically contiguous frames, for
+// buffers handed to devices.
+void *vmalloc_contiguous(size_t length, void **physical) {
+  length = page_align(length);
+  void *address = vmalloc_reserve_area(length);
+  if (!address) {
+    return NULL;
+  }
+  void *frames = get_frame(true, length / PAGE_SIZE);
+  mmu_map_physical(address, frames, length);
+  if (physical) {
+    *physical = frames;
+  }
+  return address;
+}
+
+// Resizes an area without copying. It is grown in place if the address
+// space after it is free, otherwise the frames are moved to a new area.
+// The new pages are not physically contiguous with the old ones.
+void *vrealloc(void *address, size_t length, size_t new_length) {
+  length = page_align(length);
+  new_length = page_align(new_length);
+  uintptr_t start = (uintptr_t)address;
+  if (new_length == length) {
+    return address;
+  }
+  if (new_length < length) {
+    mmu_unmap_pages((void *)(start + new_length), length - new_length);
+    // The guard page moves down with the end of the area.
+    vmalloc_give_back(start + new_length + PAGE_SIZE, length - new_length);
+    return address;
+  }
+
+  size_t extra = new_length - length;
+  lock_acquire(&vmalloc_lock);
+  bool in_place = vmalloc_reserve_at(start + length + PAGE_SIZE, extra);
+  lock_release(&vmalloc_lock);
+  if (in_place) {
+    mmu_map_pages((void *)(start + length), extra);
+    return address;
+  }
+
+  void *new_address = vmalloc_reserve_area(new_length);
+  if (!new_address) {
+    return NULL;
+  }
+  mmu_move_pages(address, new_address, length);
+  mmu_map_pages((void *)((uintptr_t)new_address + length), extra);
+  vmalloc_give_back(start, length + PAGE_SIZE);
+  return new_address;
+}
+
+void vfree(void *address, size_t length) {
+  if (!address) {
+    return;
+  }
+  length = page_align(length);
+  assert((uintptr_t)address >= VMALLOC_START &&
+         (uintptr_t)address + length <= VMALLOC_END);
+  mmu_unmap_pages(address, length);
+  vmalloc_give_back((uintptr_t)address, length + PAGE_SIZE);
+}
@@ -0,0 +1,9 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+#include <stddef.h>
+
+void *vmalloc(size_t length);
+void *vmalloc_contiguous(size_t length, void **physical);
+void *vrealloc(void *address, size_t length, size_t new_length);
+void vfree(void *address, size_t length);
+#endif // VMALLOC_H
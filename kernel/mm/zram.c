@@ -0,0 +1,230 @@
+#include <arch/amd64/msr.h>
+#include <arch/amd64/smp.h>
+#include <assert.h>
+#include <compression/LZ4/lz4.h>
+#include <kmalloc.h>
+#include <kprintf.h>
+#include <lock.h>
+#include <math.h>
+#include <mm/mempool.h>
+#include <mm/zram.h>
+#include <mmu.h>
+#include <string.h>
+
+// Anything larger than this is not worth keeping compressed.
+#define ZRAM_MAX_COMPRESSED (PAGE_SIZE * 3 / 4)
+
+#define ZRAM_NO_ENTRY ((u64)-1)
+
+// Pages are stored while memory is being reclaimed, which is when
+// kmalloc() is most likely to fail. This many can still be stored then.
+#define ZRAM_RESERVED_PAGES 8
+
+struct zram_entry {
+  // NULL if every word of the page is `value`.
+  u8 *data;
+  // Holds the next free entry while the entry is unused.
+  u64 value;
+  u16 length;
+};
+
+// Compression happens outside of zram_lock, so every core gets its own
+// scratch space.
+struct zram_scratch {
+  u16 table[LZ4_HASH_SIZE];
+  u8 buffer[ZRAM_MAX_COMPRESSED];
+};
+
+// Entries are kept in chunks of a page that never move, so a new chunk
+// is a small allocation that does not have to reclaim or copy anything.
+#define ZRAM_CHUNK_ENTRIES (PAGE_SIZE / sizeof(struct zram_entry))
+#define ZRAM_MAX_CHUNKS 4096
+
+lock_t zram_lock;
+
+struct zram_entry *zram_chunks[ZRAM_MAX_CHUNKS];
+u64 zram_num_entries = 0;
+u64 zram_free_entry = ZRAM_NO_ENTRY;
+
+// cpu_count entries.
+struct zram_scratch **zram_scratch = NULL;
+
+struct zram_stats zram_stats;
+
+struct mempool *zram_pool = NULL;
+
+bool zram_init(void) {
+  // Memory is most likely tight once the first page has to be stored,
+  // so get it now.
+  zram_pool = mempool_create_kmalloc(ZRAM_MAX_COMPRESSED, ZRAM_RESERVED_PAGES);
+  zram_scratch = kcalloc(cpu_count, sizeof(struct zram_scratch *));
+  if (!zram_pool || !zram_scratch) {
+    return false;
+  }
+  for (u32 i = 0; i < cpu_count; i++) {
+    zram_scratch[i] = kmalloc(sizeof(struct zram_scratch));
+    if (!zram_scratch[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static struct zram_entry *zram_entry_get(u64 index) {
+  assert(index < zram_num_entries);
+  return &zram_chunks[index / ZRAM_CHUNK_ENTRIES][index % ZRAM_CHUNK_ENTRIES];
+}
+
+// Called with zram_lock held, from within reclaim.
+static bool zram_alloc_entry(u64 *index) {
+  if (ZRAM_NO_ENTRY != zram_free_entry) {
+    *index = zram_free_entry;
+    zram_free_entry = zram_entry_get(*index)->value;
+    return true;
+  }
+  u64 num_chunks = zram_num_entries / ZRAM_CHUNK_ENTRIES;
+  if (ZRAM_MAX_CHUNKS == num_chunks) {
+    return false;
+  }
+  struct zram_entry *chunk = kmalloc_flags(
+      ZRAM_CHUNK_ENTRIES * sizeof(struct zram_entry), KMALLOC_ATOMIC);
+  if (!chunk) {
+    return false;
+  }
+  zram_chunks[num_chunks] = chunk;
+  for (u64 i = ZRAM_CHUNK_ENTRIES - 1; i > 0; i--) {
+    chunk[i].value = zram_free_entry;
+    zram_free_entry = zram_num_entries + i;
+  }
+  *index = zram_num_entries;
+  zram_num_entries += ZRAM_CHUNK_ENTRIES;
+  return true;
+}
+
+static bool is_same_filled(const u64 *words) {
+  for (size_t i = 1; i < PAGE_SIZE / sizeof(u64); i++) {
+    if (words[i] != words[0]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool zram_store(const void *page, u64 *handle) {
+  u64 start = rdtsc();
+
+  u8 *data = NULL;
+  size_t length = 0;
+  bool same_filled = is_same_filled(page);
+  if (!same_filled) {
+    struct zram_scratch *scratch = zram_scratch[core_id_get()];
+    length = lz4_compress(page, PAGE_SIZE, scratch->buffer,
+                          ZRAM_MAX_COMPRESSED, scratch->table);
+    if (0 == length) {
+      lock_acquire(&zram_lock);
+      zram_stats.rejected_pages++;
+      lock_release(&zram_lock);
+      return false;
+    }
+    // Called from reclaim, so nothing here may reclaim in turn.
+    data = kmalloc_flags(length, KMALLOC_ATOMIC);
+    if (!data) {
+      data = mempool_alloc_flags(zram_pool, KMALLOC_ATOMIC);
+    }
+    if (!data) {
+      return false;
+    }
+    memcpy(data, scratch->buffer, length);
+  }
+
+  lock_acquire(&zram_lock);
+  u64 index;
+  if (!zram_alloc_entry(&index)) {
+    lock_release(&zram_lock);
+    mempool_free(zram_pool, data);
+    return false;
+  }
+  struct zram_entry *entry = zram_entry_get(index);
+  entry->data = data;
+  entry->length = length;
+  entry->value = *(const u64 *)page;
+
+  zram_stats.stored_pages++;
+  if (same_filled) {
+    zram_stats.same_filled_pages++;
+  }
+  zram_stats.compressed_bytes += length;
+  zram_stats.stores++;
+  u64 cycles = rdtsc() - start;
+  zram_stats.store_cycles += cycles;
+  zram_stats.max_store_cycles = max(zram_stats.max_store_cycles, cycles);
+  lock_release(&zram_lock);
+
+  *handle = index;
+  return true;
+}
+
+bool zram_load(u64 handle, void *page) {
+  u64 start = rdtsc();
+  lock_acquire(&zram_lock);
+  struct zram_entry *entry = zram_entry_get(handle);
+
+  bool rc = true;
+  if (entry->data) {
+    rc = lz4_decompress(entry->data, entry->length, page, PAGE_SIZE);
+  } else {
+    u64 *words = page;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(u64); i++) {
+      words[i] = entry->value;
+    }
+  }
+
+  zram_stats.loads++;
+  u64 cycles = rdtsc() - start;
+  zram_stats.load_cycles += cycles;
+  zram_stats.max_load_cycles = max(zram_stats.max_load_cycles, cycles);
+  lock_release(&zram_lock);
+  return rc;
+}
+
+void zram_free(u64 handle) {
+  lock_acquire(&zram_lock);
+  struct zram_entry *entry = zram_entry_get(handle);
+  mempool_free(zram_pool, entry->data);
+
+  zram_stats.stored_pages--;
+  if (!entry->data) {
+    zram_stats.same_filled_pages--;
+  }
+  zram_stats.compressed_bytes -= entry->length;
+
+  entry->data = NULL;
+  entry->length = 0;
+  entry->value = zram_free_entry;
+  zram_free_entry = handle;
+  lock_release(&zram_lock);
+}
+
+void zram_get_stats(struct zram_stats *stats) {
+  lock_acquire(&zram_lock);
+  *stats = zram_stats;
+  lock_release(&zram_lock);
+}
+
+void zram_dump_stats(void) {
+  struct zram_stats stats;
+  zram_get_stats(&stats);
+
+  u64 original_bytes = stats.stored_pages * PAGE_SIZE;
+  // In hundredths to avoid floating point.
+  u64 ratio = (original_bytes * 100) / max(stats.compressed_bytes, 1);
+  kprintf("zram: stored pages: %ld (same filled: %ld)\n", stats.stored_pages,
+          stats.same_filled_pages);
+  kprintf("zram: %ld bytes compressed to %ld, ratio: %ld.%02ld\n",
+          original_bytes, stats.compressed_bytes, ratio / 100, ratio % 100);
+  kprintf("zram: rejected pages: %ld\n", stats.rejected_pages);
+  kprintf("zram: store cycles avg: %ld max: %ld\n",
+          stats.store_cycles / max(stats.stores, 1), stats.max_store_cycles);
+  kprintf("zram: load cycles avg: %ld max: %ld\n",
+          stats.load_cycles / max(stats.loads, 1), stats.max_load_cycles);
+}
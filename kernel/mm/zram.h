@@ -0,0 +1,27 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+#include <stdbool.h>
+#include <typedefs.h>
+
+struct zram_stats {
+  u64 stored_pages;
+  // Pages where every word is the same, these take no space.
+  u64 same_filled_pages;
+  u64 compressed_bytes;
+  // Pages that did not compress well enough to be worth storing.
+  u64 rejected_pages;
+  u64 stores;
+  u64 loads;
+  u64 store_cycles;
+  u64 load_cycles;
+  u64 max_store_cycles;
+  u64 max_load_cycles;
+};
+
+bool zram_init(void);
+bool zram_store(const void *page, u64 *handle);
+bool zram_load(u64 handle, void *page);
+void zram_free(u64 handle);
+void zram_get_stats(struct zram_stats *stats);
+void zram_dump_stats(void);
+#endif // ZRAM_H
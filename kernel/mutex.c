@@ -0,0 +1,58 @@
+#include <arch/amd64/percpu.h>
+#include <atomic.h>
+#include <mutex.h>
+#include <stddef.h>
+#include <task.h>
+
+#define MUTEX_UNLOCKED 0
+#define MUTEX_LOCKED 1
+// Locked and tasks may be sleeping on `wait`.
+#define MUTEX_CONTENDED 2
+
+// Spin iterations before sleeping while the owner keeps running.
+#define MUTEX_SPIN_LIMIT 1000
+
+bool mutex_trylock(struct mutex *mutex) {
+  u32 expected = MUTEX_UNLOCKED;
+  if (!atomic_cmpxchg_acquire(&mutex->state, &expected, MUTEX_LOCKED)) {
+    return false;
+  }
+  atomic_store_relaxed(&mutex->owner, this_cpu_read(current_task));
+  return true;
+}
+
+void mutex_lock(struct mutex *mutex) {
+  if (mutex_trylock(mutex)) {
+    return;
+  }
+
+  for (u32 i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+    struct task *owner = atomic_load_relaxed(&mutex->owner);
+    if (owner && !atomic_load_relaxed(&owner->on_cpu)) {
+      break;
+    }
+    if (MUTEX_UNLOCKED == atomic_load_relaxed(&mutex->state) &&
+        mutex_trylock(mutex)) {
+      return;
+    }
+    cpu_relax();
+  }
+
+  // Marking the mutex as contended makes the owner wake a waiter, if it
+  // was unlocked in the meantime it is ours.
+  u64 flags = lock_acquire_irqsave(&mutex->wait.lock);
+  for (; MUTEX_UNLOCKED !=
+         atomic_xchg_acquire(&mutex->state, MUTEX_CONTENDED);) {
+    wait_queue_sleep(&mutex->wait, &flags);
+  }
+  lock_release_irqrestore(&mutex->wait.lock, flags);
+  atomic_store_relaxed(&mutex->owner, this_cpu_read(current_task));
+}
+
+void mutex_unlock(struct mutex *mutex) {
+  atomic_store_relaxed(&mutex->owner, NULL);
+  if (MUTEX_CONTENDED != atomic_xchg_release(&mutex->state, MUTEX_UNLOCKED)) {
+    return;
+  }
+  wait_queue_wake_one(&mutex->wait);
+}
@@ -0,0 +1,22 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+#include <stdbool.h>
+#include <typedefs.h>
+#include <wait_queue.h>
+
+struct task;
+
+// Sleeping lock for long critical sections. A waiter first spins for a
+// while as long as the owner is running, since it is likely to release
+// the mutex soon, and then sleeps. Only tasks may take it, not interrupt
+// handlers. A zeroed mutex is unlocked.
+struct mutex {
+  u32 state;
+  struct task *owner;
+  struct wait_queue wait;
+};
+
+void mutex_lock(struct mutex *mutex);
+bool mutex_trylock(struct mutex *mutex);
+void mutex_unlock(struct mutex *mutex);
+#endif // MUTEX_H
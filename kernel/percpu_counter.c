@@ -0,0 +1,65 @@
+#include <arch/amd64/smp.h>
+#include <kmalloc.h>
+#include <percpu_counter.h>
+#ifdef KERNEL_TEST
+#include <arch/amd64/msr.h>
+#include <kprintf.h>
+#endif // KERNEL_TEST
+
+// The add is still atomic since the task may move to another core
+// between reading the core ID and adding, and interrupt handlers may
+// add as well. It stays cheap as the line is not shared.
+
+bool percpu_counter_init(struct percpu_counter *counter) {
+  counter->slots = kcalloc(cpu_count, sizeof(struct percpu_counter_slot));
+  return (NULL != counter->slots);
+}
+
+void percpu_counter_free(struct percpu_counter *counter) {
+  kfree(counter->slots);
+  counter->slots = NULL;
+}
+
+void percpu_counter_add(struct percpu_counter *counter, i64 delta) {
+  atomic_fetch_add_relaxed(&counter->slots[core_id_get()].value, delta);
+}
+
+i64 percpu_counter_sum(struct percpu_counter *counter) {
+  i64 sum = 0;
+  for (u32 i = 0; i < cpu_count; i++) {
+    sum += atomic_load_relaxed(&counter->slots[i].value);
+  }
+  return sum;
+}
+
+// Adds that race with the reset may survive it.
+void percpu_counter_reset(struct percpu_counter *counter) {
+  for (u32 i = 0; i < cpu_count; i++) {
+    atomic_store_relaxed(&counter->slots[i].value, 0);
+  }
+}
+
+#ifdef KERNEL_TEST
+struct percpu_counter percpu_counter_benchmark_counter;
+i64 percpu_counter_benchmark_shared;
+
+// Meant to be run on every core at the same time, after the counter
+// has been set up. The shared counter is there to compare against.
+u64 percpu_counter_benchmark(u32 rounds) {
+  u64 start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    atomic_fetch_add_relaxed(&percpu_counter_benchmark_shared, 1);
+  }
+  u64 shared_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    percpu_counter_add(&percpu_counter_benchmark_counter, 1);
+  }
+  u64 percpu_cycles = rdtsc() - start;
+
+  kprintf("percpu_counter: core %d: shared: %ld per-cpu: %ld cycles per add\n",
+          core_id_get(), shared_cycles / rounds, percpu_cycles / rounds);
+  return percpu_cycles;
+}
+#endif // KERNEL_TEST
@@ -0,0 +1,29 @@
+#ifndef PERCPU_COUNTER_H
+#define PERCPU_COUNTER_H
+#include <atomic.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+// Counter for statistics that are bumped often from every core and
+// read rarely. Every core adds to its own cache line, so adding never
+// contends. Reading has to sum up all cores and is not exact while the
+// counter changes. Takes a cache line per core, so it has to be set up
+// with percpu_counter_init() once the cores are known.
+struct percpu_counter_slot {
+  i64 value;
+} CACHE_LINE_ALIGNED;
+
+struct percpu_counter {
+  // cpu_count entries.
+  struct percpu_counter_slot *slots;
+};
+
+bool percpu_counter_init(struct percpu_counter *counter);
+void percpu_counter_free(struct percpu_counter *counter);
+void percpu_counter_add(struct percpu_counter *counter, i64 delta);
+i64 percpu_counter_sum(struct percpu_counter *counter);
+void percpu_counter_reset(struct percpu_counter *counter);
+#ifdef KERNEL_TEST
+u64 percpu_counter_benchmark(u32 rounds);
+#endif // KERNEL_TEST
+#endif // PERCPU_COUNTER_H
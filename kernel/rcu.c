@@ -0,0 +1,119 @@
+#include <arch/amd64/idt.h>
+#include <arch/amd64/smp.h>
+#include <assert.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <rcu.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Every call_rcu() and synchronize_rcu() starts a new grace period by
+// incrementing `rcu_grace_period`. At a quiescent state a core records
+// the number it sees, any reader the core had running when a grace
+// period started has finished by then. So grace period `n` is over once
+// every online core has recorded a number of at least `n`.
+//
+// Callbacks are kept on the core that queued them, in the order of
+// their grace periods, and run at that core's quiescent states.
+
+struct rcu_data {
+  u64 quiescent;
+  bool online;
+  struct rcu_head *head;
+  struct rcu_head **tail;
+} __attribute__((aligned(64)));
+
+u64 rcu_grace_period = 0;
+// cpu_count entries.
+struct rcu_data *rcu_data = NULL;
+
+bool rcu_init(void) {
+  rcu_data = kcalloc(cpu_count, sizeof(struct rcu_data));
+  return (NULL != rcu_data);
+}
+
+// Called once on every core before it takes part. Until then it is not
+// waited for.
+void rcu_cpu_online(void) {
+  struct rcu_data *data = &rcu_data[core_id_get()];
+  data->head = NULL;
+  data->tail = &data->head;
+  atomic_store_release(&data->quiescent,
+                       atomic_load_seq_cst(&rcu_grace_period));
+  atomic_store_release(&data->online, true);
+}
+
+// The newest grace period that is over.
+static u64 rcu_completed(void) {
+  u64 completed = atomic_load_seq_cst(&rcu_grace_period);
+  for (u32 i = 0; i < cpu_count; i++) {
+    struct rcu_data *data = &rcu_data[i];
+    if (!atomic_load_acquire(&data->online)) {
+      continue;
+    }
+    u64 quiescent = atomic_load_acquire(&data->quiescent);
+    if (quiescent < completed) {
+      completed = quiescent;
+    }
+  }
+  return completed;
+}
+
+// Must not be called from within a read-side critical section.
+void rcu_quiescent_state(void) {
+  u64 flags = interrupts_save_disable();
+  struct rcu_data *data = &rcu_data[core_id_get()];
+  atomic_store_release(&data->quiescent,
+                       atomic_load_seq_cst(&rcu_grace_period));
+  if (!data->head) {
+    interrupts_restore(flags);
+    return;
+  }
+  u64 completed = rcu_completed();
+  struct rcu_head *done = NULL;
+  struct rcu_head **done_tail = &done;
+  for (; data->head && data->head->grace_period <= completed;) {
+    *done_tail = data->head;
+    done_tail = &data->head->next;
+    data->head = data->head->next;
+  }
+  *done_tail = NULL;
+  if (!data->head) {
+    data->tail = &data->head;
+  }
+  interrupts_restore(flags);
+
+  for (; done;) {
+    struct rcu_head *next = done->next;
+    done->func(done);
+    done = next;
+  }
+}
+
+// `func` is called once no reader can see the object anymore. It runs
+// on this core at a later quiescent state, possibly from an interrupt
+// handler.
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+  head->func = func;
+  head->next = NULL;
+  u64 flags = interrupts_save_disable();
+  struct rcu_data *data = &rcu_data[core_id_get()];
+  assert(data->online);
+  head->grace_period = atomic_fetch_add_seq_cst(&rcu_grace_period, 1) + 1;
+  *data->tail = head;
+  data->tail = &head->next;
+  interrupts_restore(flags);
+}
+
+// Waits for all readers that were running when called. Spins, so the
+// other cores have to get to a quiescent state by themselves.
+void synchronize_rcu(void) {
+  u64 grace_period = atomic_fetch_add_seq_cst(&rcu_grace_period, 1) + 1;
+  for (;;) {
+    rcu_quiescent_state();
+    if (rcu_completed() >= grace_period) {
+      return;
+    }
+    cpu_relax();
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef RCU_H
+#define RCU_H
+#include <arch/amd64/preempt.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+// Read-copy-update for read-mostly lists. Readers take no lock and write
+// nothing shared:
+//
+//   rcu_read_lock();
+//   for (p = rcu_dereference(head); p; p = rcu_dereference(p->next)) {
+//     ...
+//   }
+//   rcu_read_unlock();
+//
+// Writers serialise among themselves with a lock, publish changes with
+// rcu_assign_pointer() and free what they unlinked with call_rcu() or
+// after synchronize_rcu(), once no reader can still be looking at it.
+//
+// A reader may not sleep or be switched away from, so passing through a
+// task switch or the idle loop is a quiescent state for the core.
+
+#define rcu_read_lock() preempt_disable()
+#define rcu_read_unlock() preempt_enable()
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Embedded in the object that is to be freed.
+struct rcu_head {
+  struct rcu_head *next;
+  void (*func)(struct rcu_head *head);
+  u64 grace_period;
+};
+
+bool rcu_init(void);
+void rcu_cpu_online(void);
+void rcu_quiescent_state(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+#endif // RCU_H
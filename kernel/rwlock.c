@@ -0,0 +1,117 @@
+#include <arch/amd64/smp.h>
+#include <atomic.h>
+#include <kmalloc.h>
+#include <rwlock.h>
+#ifdef KERNEL_TEST
+#include <arch/amd64/msr.h>
+#include <assert.h>
+#include <kprintf.h>
+#include <seqlock.h>
+#endif // KERNEL_TEST
+
+// A reader first announces itself on its core's counter and then checks
+// for a writer, a writer first sets `writer` and then checks the
+// counters. Both use sequentially consistent operations so that at
+// least one of them sees the other. A reader that sees a writer backs
+// off until it is done, so writers do not starve.
+
+bool rwlock_init(struct rwlock *lock) {
+  lock->writer = 0;
+  lock->writer_lock = 0;
+  lock->readers = kcalloc(cpu_count, sizeof(struct rwlock_reader));
+  return (NULL != lock->readers);
+}
+
+void rwlock_free(struct rwlock *lock) {
+  kfree(lock->readers);
+  lock->readers = NULL;
+}
+
+u32 rwlock_read_acquire(struct rwlock *lock) {
+  u32 slot = core_id_get();
+  u32 *count = &lock->readers[slot].count;
+  for (;;) {
+    atomic_fetch_add_seq_cst(count, 1);
+    if (!atomic_load_seq_cst(&lock->writer)) {
+      return slot;
+    }
+    atomic_fetch_sub_release(count, 1);
+    for (; atomic_load_relaxed(&lock->writer);) {
+      cpu_relax();
+    }
+  }
+}
+
+void rwlock_read_release(struct rwlock *lock, u32 slot) {
+  atomic_fetch_sub_release(&lock->readers[slot].count, 1);
+}
+
+void rwlock_write_acquire(struct rwlock *lock) {
+  lock_acquire(&lock->writer_lock);
+  atomic_store_seq_cst(&lock->writer, 1);
+  for (u32 i = 0; i < cpu_count; i++) {
+    u32 *count = &lock->readers[i].count;
+    for (; atomic_load_acquire(count);) {
+      cpu_relax();
+    }
+  }
+}
+
+void rwlock_write_release(struct rwlock *lock) {
+  atomic_store_release(&lock->writer, 0);
+  lock_release(&lock->writer_lock);
+}
+
+#ifdef KERNEL_TEST
+lock_t rwlock_benchmark_lock;
+struct rwlock rwlock_benchmark_rwlock;
+struct seqlock rwlock_benchmark_seqlock;
+u64 rwlock_benchmark_value;
+
+// Meant to be run on every core at the same time. Only reads, which is
+// the case the rwlock and the seqlock are for. With more cores the
+// lock_t should get slower since every reader writes to the same line,
+// the other two should not.
+u64 rwlock_benchmark(u32 rounds) {
+  lock_acquire(&rwlock_benchmark_lock);
+  if (!rwlock_benchmark_rwlock.readers) {
+    assert(rwlock_init(&rwlock_benchmark_rwlock));
+  }
+  lock_release(&rwlock_benchmark_lock);
+
+  u64 sum = 0;
+  u64 start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    lock_acquire(&rwlock_benchmark_lock);
+    sum += rwlock_benchmark_value;
+    lock_release(&rwlock_benchmark_lock);
+  }
+  u64 lock_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    u32 slot = rwlock_read_acquire(&rwlock_benchmark_rwlock);
+    sum += rwlock_benchmark_value;
+    rwlock_read_release(&rwlock_benchmark_rwlock, slot);
+  }
+  u64 rwlock_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (u32 i = 0; i < rounds; i++) {
+    u32 seq;
+    u64 value;
+    do {
+      seq = seqlock_read_begin(&rwlock_benchmark_seqlock);
+      value = rwlock_benchmark_value;
+    } while (seqlock_read_retry(&rwlock_benchmark_seqlock, seq));
+    sum += value;
+  }
+  u64 seqlock_cycles = rdtsc() - start;
+
+  kprintf("rwlock: core %d: lock_t: %ld rwlock: %ld seqlock: %ld cycles "
+          "per read\n",
+          core_id_get(), lock_cycles / rounds, rwlock_cycles / rounds,
+          seqlock_cycles / rounds);
+  return sum;
+}
+#endif // KERNEL_TEST
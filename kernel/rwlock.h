@@ -0,0 +1,37 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+#include <lock.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+// Reader-writer lock for data that is read far more often than it is
+// written. Every core counts its readers on its own cache line, so
+// readers on different cores never write to a shared line. A writer
+// has to wait for the counters of all cores, which makes writing
+// expensive. A lock takes a cache line per core, so it has to be set up
+// with rwlock_init() once the cores are known.
+//
+// Not to be taken from interrupt handlers.
+struct rwlock_reader {
+  u32 count;
+} __attribute__((aligned(64)));
+
+struct rwlock {
+  // cpu_count entries.
+  struct rwlock_reader *readers;
+  u32 writer;
+  lock_t writer_lock;
+};
+
+// Returns the slot that has to be passed to rwlock_read_release(), the
+// reader may have moved to another core in between.
+bool rwlock_init(struct rwlock *lock);
+void rwlock_free(struct rwlock *lock);
+u32 rwlock_read_acquire(struct rwlock *lock);
+void rwlock_read_release(struct rwlock *lock, u32 slot);
+void rwlock_write_acquire(struct rwlock *lock);
+void rwlock_write_release(struct rwlock *lock);
+#ifdef KERNEL_TEST
+u64 rwlock_benchmark(u32 rounds);
+#endif // KERNEL_TEST
+#endif // RWLOCK_H
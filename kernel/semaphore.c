@@ -0,0 +1,35 @@
+#include <semaphore.h>
+
+// The count is protected by the lock of the wait queue.
+
+void semaphore_init(struct semaphore *sem, u32 count) {
+  sem->count = count;
+  sem->wait = (struct wait_queue){0};
+}
+
+void semaphore_down(struct semaphore *sem) {
+  u64 flags = lock_acquire_irqsave(&sem->wait.lock);
+  for (; 0 == sem->count;) {
+    wait_queue_sleep(&sem->wait, &flags);
+  }
+  sem->count--;
+  lock_release_irqrestore(&sem->wait.lock, flags);
+}
+
+bool semaphore_try_down(struct semaphore *sem) {
+  u64 flags = lock_acquire_irqsave(&sem->wait.lock);
+  bool taken = (sem->count > 0);
+  if (taken) {
+    sem->count--;
+  }
+  lock_release_irqrestore(&sem->wait.lock, flags);
+  return taken;
+}
+
+// May be called from interrupt handlers.
+void semaphore_up(struct semaphore *sem) {
+  u64 flags = lock_acquire_irqsave(&sem->wait.lock);
+  sem->count++;
+  wait_queue_wake_one_locked(&sem->wait);
+  lock_release_irqrestore(&sem->wait.lock, flags);
+}
@@ -0,0 +1,17 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+#include <stdbool.h>
+#include <typedefs.h>
+#include <wait_queue.h>
+
+// Counting semaphore, semaphore_down() sleeps while the count is zero.
+struct semaphore {
+  u32 count;
+  struct wait_queue wait;
+};
+
+void semaphore_init(struct semaphore *sem, u32 count);
+void semaphore_down(struct semaphore *sem);
+bool semaphore_try_down(struct semaphore *sem);
+void semaphore_up(struct semaphore *sem);
+#endif // SEMAPHORE_H
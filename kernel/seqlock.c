@@ -0,0 +1,32 @@
+#include <atomic.h>
+#include <seqlock.h>
+
+// The sequence is odd while a writer is active.
+
+u32 seqlock_read_begin(struct seqlock *lock) {
+  for (;;) {
+    u32 sequence = atomic_load_acquire(&lock->sequence);
+    if (!(sequence & 1)) {
+      return sequence;
+    }
+    cpu_relax();
+  }
+}
+
+bool seqlock_read_retry(struct seqlock *lock, u32 sequence) {
+  // Orders the reads of the record before the sequence is read again.
+  atomic_fence_acquire();
+  return atomic_load_relaxed(&lock->sequence) != sequence;
+}
+
+void seqlock_write_acquire(struct seqlock *lock) {
+  lock_acquire(&lock->lock);
+  atomic_store_relaxed(&lock->sequence, lock->sequence + 1);
+  // Readers must see the odd sequence before any of the writes.
+  atomic_fence_release();
+}
+
+void seqlock_write_release(struct seqlock *lock) {
+  atomic_store_release(&lock->sequence, lock->sequence + 1);
+  lock_release(&lock->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+#include <lock.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+// For small records that are read often, such as a clock. Readers do
+// not write anything, they copy the record and retry if a writer was
+// active in the meantime:
+//
+//   u32 seq;
+//   do {
+//     seq = seqlock_read_begin(&lock);
+//     copy = record;
+//   } while (seqlock_read_retry(&lock, seq));
+//
+// So readers have to cope with seeing a half written record until the
+// retry check, which rules out following pointers in it.
+struct seqlock {
+  u32 sequence;
+  lock_t lock;
+};
+
+u32 seqlock_read_begin(struct seqlock *lock);
+bool seqlock_read_retry(struct seqlock *lock, u32 sequence);
+void seqlock_write_acquire(struct seqlock *lock);
+void seqlock_write_release(struct seqlock *lock);
+#endif // SEQLOCK_H
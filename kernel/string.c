@@ -66,3 +66,19 @@ void *memset(void *s, int c, size_t n) {
   }
   return s;
 }
+
+int memcmp(const void *s1, const void *s2, size_t n) {
+  const unsigned char *a = s1;
+  const unsigned char *b = s2;
+  for (; n >= 8; n -= 8, a += 8, b += 8) {
+    if (*(u64 *)a != *(u64 *)b) {
+      break;
+    }
+  }
+  for (; n > 0; n--, a++, b++) {
+    if (*a != *b) {
+      return *a - *b;
+    }
+  }
+  return 0;
+}
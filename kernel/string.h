@@ -3,4 +3,5 @@
 size_t strlen(const char *s);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 int strncmp(const char *s1, const char *s2, size_t n);
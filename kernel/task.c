@@ -1,26 +1,40 @@
+#include <arch/amd64/idt.h>
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/preempt.h>
 #include <arch/amd64/task_switch.h>
 #include <assert.h>
+#include <atomic.h>
 #include <kmalloc.h>
 #include <kprintf.h>
+#include <mm/slab.h>
+#include <rcu.h>
 #include <stddef.h>
 #include <task.h>
 
 struct task *task_head = NULL;
-struct task *task_current = NULL;
 u64 active_pid = 0;
 
+struct kmem_cache *task_cache = NULL;
+
 bool task_init(void) {
-  task_head = kmalloc(sizeof(struct task));
+  task_cache = kmem_cache_create("task", sizeof(struct task), CACHE_LINE_SIZE,
+                                 NULL);
+  if (!task_cache) {
+    return false;
+  }
+  task_head = kmem_cache_alloc(task_cache);
   if (!task_head) {
     return false;
   }
   task_head->next = NULL;
+  task_head->state = TASK_RUNNABLE;
+  task_head->on_cpu = 1;
   task_head->pid = active_pid;
   active_pid++;
 
   task_head->directory = mmu_get_active_directory();
 
-  task_current = task_head;
+  this_cpu_write(current_task, task_head);
 
   return true;
 }
@@ -33,16 +47,18 @@ void task_create_directory(struct task *task, struct task *parent) {
 u64 task_fork(bool *err) {
   PTR_ASSIGN(err, false);
 
-  struct task *parent = task_current;
+  struct task *parent = this_cpu_read(current_task);
   assert(parent);
 
-  struct task *task = kmalloc(sizeof(struct task));
+  struct task *task = kmem_cache_alloc(task_cache);
   if (!task) {
     PTR_ASSIGN(err, true);
     return false;
   }
   task->pid = active_pid;
   active_pid++;
+  task->state = TASK_RUNNABLE;
+  task->on_cpu = 0;
 
   task->next = task_head;
   task_head = task;
@@ -51,8 +67,11 @@ u64 task_fork(bool *err) {
 }
 
 void task_switch(struct task *task) {
-  struct task *old = task_current;
-  task_current = task;
+  struct task *old = this_cpu_read(current_task);
+  this_cpu_write(current_task, task);
+  rcu_quiescent_state();
+  atomic_store_release(&old->on_cpu, 0);
+  atomic_store_release(&task->on_cpu, 1);
   switch_to_task(old, task);
 }
 
@@ -64,7 +83,61 @@ struct task *task_next(struct task *task) {
   return task;
 }
 
+// The next runnable task after `task`, which may be `task` itself. NULL
+// if nothing can run.
+static struct task *task_next_runnable(struct task *task) {
+  struct task *next = task;
+  for (;;) {
+    next = task_next(next);
+    if (TASK_RUNNABLE == atomic_load_acquire(&next->state)) {
+      return next;
+    }
+    if (next == task) {
+      return NULL;
+    }
+  }
+}
+
 void task_legacy_switch(void) {
-  struct task *new_task = task_next(task_current);
+  struct task *current = this_cpu_read(current_task);
+  struct task *new_task = task_next_runnable(current);
+  if (!new_task || new_task == current) {
+    return;
+  }
   task_switch(new_task);
 }
+
+// Lets other runnable tasks run. Returns once the current task is
+// runnable and gets picked again, so a task that marked itself as
+// sleeping only returns after task_wake(). Does nothing where switching
+// is not allowed, callers have to check their condition again. That is
+// also the case with interrupts disabled by the caller.
+void task_schedule(void) {
+  struct task *current = this_cpu_read(current_task);
+  if (!current || in_interrupt() || preempt_count() > 0) {
+    return;
+  }
+  u64 flags = interrupts_save_disable();
+  if (!(flags & RFLAGS_IF)) {
+    return;
+  }
+  for (;;) {
+    struct task *next = task_next_runnable(current);
+    if (next == current) {
+      break;
+    }
+    if (next) {
+      task_switch(next);
+      break;
+    }
+    // Nothing can run, an interrupt or another core has to wake a task.
+    interrupts_restore(flags);
+    cpu_relax();
+    flags = interrupts_save_disable();
+  }
+  interrupts_restore(flags);
+}
+
+void task_wake(struct task *task) {
+  atomic_store_release(&task->state, TASK_RUNNABLE);
+}
@@ -9,15 +9,26 @@ struct tcb {
   u64 rsp0;
 } __attribute__((packed));
 
+enum task_state {
+  TASK_RUNNABLE,
+  // Waiting on a wait queue, only task_wake() makes it runnable again.
+  TASK_SLEEPING,
+};
+
 struct task {
   // NOTE: Assembly code depends upon the TCB being at the start
   struct tcb tcb;
   u64 pid;
   struct mmu_directory *directory;
   struct task *next;
-} __attribute__((packed));
+  u32 state;
+  // Set while the task is running on a core.
+  u32 on_cpu;
+};
 
 bool task_init(void);
 u64 task_fork(bool *err);
 void task_legacy_switch(void);
+void task_schedule(void);
+void task_wake(struct task *task);
 #endif // TASK_H
@@ -21,5 +21,6 @@ typedef union {
   u32 d;
 } ipv4_t;
 
+#define U16_MAX 65535
 #define U32_MAX 4294967295
 #endif
@@ -0,0 +1,82 @@
+#include <arch/amd64/idt.h>
+#include <arch/amd64/percpu.h>
+#include <arch/amd64/preempt.h>
+#include <atomic.h>
+#include <stddef.h>
+#include <task.h>
+#include <wait_queue.h>
+
+// Called with `wq->lock` held, `flags` being what lock_acquire_irqsave()
+// returned. Sleeps until woken and returns with the lock held again, so
+// the caller has to check its condition again.
+//
+// Without a task to put to sleep, such as early during boot, or where
+// switching is not allowed the lock is only dropped for a moment and
+// the caller ends up spinning. `wq->lock` itself accounts for one level
+// of the preempt count, any further level means another lock is held.
+// Neither may it switch if the caller had interrupts disabled.
+void wait_queue_sleep(struct wait_queue *wq, u64 *flags) {
+  struct task *task = this_cpu_read(current_task);
+  if (!task || in_interrupt() || preempt_count() > 1 ||
+      !(*flags & RFLAGS_IF)) {
+    lock_release_irqrestore(&wq->lock, *flags);
+    cpu_relax();
+    *flags = lock_acquire_irqsave(&wq->lock);
+    return;
+  }
+
+  struct wait_queue_entry entry = {.task = task, .next = NULL};
+  if (wq->head) {
+    wq->tail->next = &entry;
+  } else {
+    wq->head = &entry;
+  }
+  wq->tail = &entry;
+  // Before the lock is dropped, so a wake up in between is not lost.
+  atomic_store_relaxed(&task->state, TASK_SLEEPING);
+  lock_release_irqrestore(&wq->lock, *flags);
+
+  task_schedule();
+
+  *flags = lock_acquire_irqsave(&wq->lock);
+}
+
+// Called with `wq->lock` held. Returns false if nobody was waiting.
+bool wait_queue_wake_one_locked(struct wait_queue *wq) {
+  struct wait_queue_entry *entry = wq->head;
+  if (!entry) {
+    return false;
+  }
+  wq->head = entry->next;
+  // The entry is gone as soon as the task runs again.
+  struct task *task = entry->task;
+  task_wake(task);
+  return true;
+}
+
+void wait_queue_wake_all_locked(struct wait_queue *wq) {
+  for (; wait_queue_wake_one_locked(wq);)
+    ;
+}
+
+// Sleeps until `condition` holds, it is checked with `wq->lock` held.
+void wait_queue_wait(struct wait_queue *wq, bool (*condition)(void *arg),
+                     void *arg) {
+  u64 flags = lock_acquire_irqsave(&wq->lock);
+  for (; !condition(arg);) {
+    wait_queue_sleep(wq, &flags);
+  }
+  lock_release_irqrestore(&wq->lock, flags);
+}
+
+void wait_queue_wake_one(struct wait_queue *wq) {
+  u64 flags = lock_acquire_irqsave(&wq->lock);
+  wait_queue_wake_one_locked(wq);
+  lock_release_irqrestore(&wq->lock, flags);
+}
+
+void wait_queue_wake_all(struct wait_queue *wq) {
+  u64 flags = lock_acquire_irqsave(&wq->lock);
+  wait_queue_wake_all_locked(wq);
+  lock_release_irqrestore(&wq->lock, flags);
+}
@@ -0,0 +1,32 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+#include <lock.h>
+#include <stdbool.h>
+#include <typedefs.h>
+
+struct task;
+
+// Lives on the stack of the sleeping task.
+struct wait_queue_entry {
+  struct task *task;
+  struct wait_queue_entry *next;
+};
+
+// Tasks waiting for something, woken in FIFO order. `lock` is taken
+// with interrupts disabled so that interrupt handlers can wake tasks,
+// and also protects whatever the tasks wait for. A zeroed queue is
+// empty.
+struct wait_queue {
+  lock_t lock;
+  struct wait_queue_entry *head;
+  struct wait_queue_entry *tail;
+};
+
+void wait_queue_sleep(struct wait_queue *wq, u64 *flags);
+bool wait_queue_wake_one_locked(struct wait_queue *wq);
+void wait_queue_wake_all_locked(struct wait_queue *wq);
+void wait_queue_wait(struct wait_queue *wq, bool (*condition)(void *arg),
+                     void *arg);
+void wait_queue_wake_one(struct wait_queue *wq);
+void wait_queue_wake_all(struct wait_queue *wq);
+#endif // WAIT_QUEUE_H